@@ -0,0 +1,389 @@
+// CPU microbenchmarks for the scene's hot kernels: mesh generation, camera math, per-frame matrix
+// setup, occlusion culling per view, the terrain chunk sort and the particle step. None of them touch GL or
+// open a window, so they run on build machines without a GPU. Results are printed as JSON.
+//
+// Build the benchmark target from CMakeLists.txt, then run it, optionally with a substring that
+// case names must contain (e.g. mesh/):
+//     cmake -S . -B build -DSCENE_DEPS_DIR=/path/to/deps && cmake --build build --target benchmark
+//     ./build/benchmark mesh/ > benchmark.json
+#define SCENE_NO_MAIN
+
+// GCC sees the counting operator new below inlined into the containers and flags the matching frees
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+#include "7-1 Final.cpp"
+
+#include <cstdlib>
+#include <new>
+#include <string>
+
+// Every allocation in the process goes through here, so cases can report allocations per op
+std::atomic<long long> allocationCount(0);
+
+void* operator new(std::size_t size)
+{
+    ++allocationCount;
+    if (void* memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+// Benchmark settings
+const double minBenchmarkSeconds = 0.25; // Iterations double until one run takes at least this long
+
+// One parameterized case; run(iterations) sets up, then repeats the operation between
+// startBenchmarkTimer and stopBenchmarkTimer, each repetition covering itemsPerOp items
+struct BenchmarkCase
+{
+    std::string name;
+    double itemsPerOp;
+    std::function<void(int)> run;
+};
+
+std::vector<BenchmarkCase> benchmarkCases;
+
+// Time and allocations of the measured part of the current run
+std::chrono::steady_clock::time_point benchmarkStartTime, benchmarkStopTime;
+long long benchmarkStartAllocations = 0, benchmarkAllocations = 0;
+
+void startBenchmarkTimer()
+{
+    benchmarkStartAllocations = allocationCount;
+    benchmarkStartTime = std::chrono::steady_clock::now();
+}
+
+void stopBenchmarkTimer()
+{
+    benchmarkStopTime = std::chrono::steady_clock::now();
+    benchmarkAllocations = allocationCount - benchmarkStartAllocations;
+}
+
+// Results are folded in here so the compiler can't drop the work
+volatile float benchmarkSink = 0.0f;
+
+// Wall occluder for the culling cases: a 4 x 2 quad standing at z = 0
+const GLfloat benchmarkWallVertices[] = {
+    -2.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+     2.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 0.0f,
+     2.0f, 2.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
+    -2.0f, 2.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f
+};
+const GLuint benchmarkWallIndices[] = { 0, 1, 2, 2, 3, 0 };
+
+// Tessellation levels from a quarter to eight times the scene's
+void addMeshCases()
+{
+    const int levels[][2] = { { 5, 5 }, { 10, 10 }, { 20, 10 }, { 40, 20 }, { 80, 40 }, { 160, 80 } };
+    for (const auto& level : levels)
+    {
+        int segments = level[0], rings = level[1];
+        std::string size = std::to_string(segments) + "x" + std::to_string(rings);
+
+        benchmarkCases.push_back({ "mesh/torus/" + size, segments * rings * 2.0, [segments, rings](int iterations) {
+            std::vector<GLfloat> vertices((segments + 1) * (rings + 1) * 8);
+            std::vector<GLuint> indices(segments * rings * 6);
+            startBenchmarkTimer();
+            for (int i = 0; i < iterations; ++i)
+            {
+                generateTorusMesh(segments, rings, vertices.data(), indices.data());
+                benchmarkSink = benchmarkSink + vertices[i % vertices.size()];
+            }
+            stopBenchmarkTimer();
+        } });
+
+        benchmarkCases.push_back({ "mesh/sphere/" + size, segments * rings * 2.0, [segments, rings](int iterations) {
+            std::vector<GLfloat> vertices((segments + 1) * (rings + 1) * 8);
+            std::vector<GLuint> indices(segments * rings * 6);
+            startBenchmarkTimer();
+            for (int i = 0; i < iterations; ++i)
+            {
+                generateSphereMesh(segments, rings, vertices.data(), indices.data());
+                benchmarkSink = benchmarkSink + vertices[i % vertices.size()];
+            }
+            stopBenchmarkTimer();
+        } });
+
+        benchmarkCases.push_back({ "mesh/cylinder/" + std::to_string(segments), segments * 2.0, [segments](int iterations) {
+            std::vector<GLfloat> vertices((segments + 1) * 2 * 8);
+            std::vector<GLuint> indices(segments * 6);
+            startBenchmarkTimer();
+            for (int i = 0; i < iterations; ++i)
+            {
+                generateCylinderMesh(segments, vertices.data(), indices.data());
+                benchmarkSink = benchmarkSink + vertices[i % vertices.size()];
+            }
+            stopBenchmarkTimer();
+        } });
+    }
+}
+
+// Keyboard movement with every key held (so every branch runs) and mouse orbit and pan
+void addCameraCases()
+{
+    benchmarkCases.push_back({ "camera/transformCamera", 1.0, [](int iterations) {
+        initCamera();
+        deltaTime = 1.0f / 60.0f;
+        for (int key : { GLFW_KEY_W, GLFW_KEY_A, GLFW_KEY_S, GLFW_KEY_D, GLFW_KEY_Q, GLFW_KEY_E })
+            keys[key] = true;
+        startBenchmarkTimer();
+        for (int i = 0; i < iterations; ++i)
+            benchmarkSink = benchmarkSink + (transformCamera() ? 1.0f : 0.0f);
+        stopBenchmarkTimer();
+        for (int key : { GLFW_KEY_W, GLFW_KEY_A, GLFW_KEY_S, GLFW_KEY_D, GLFW_KEY_Q, GLFW_KEY_E })
+            keys[key] = false;
+    } });
+
+    for (int orbit = 0; orbit < 2; ++orbit)
+    {
+        benchmarkCases.push_back({ orbit ? "camera/cursor_position_callback/orbit" : "camera/cursor_position_callback/pan", 1.0, [orbit](int iterations) {
+            initCamera();
+            deltaTime = 1.0f / 60.0f;
+            isOrbiting = orbit != 0;
+            isPanning = orbit == 0;
+            startBenchmarkTimer();
+            for (int i = 0; i < iterations; ++i)
+                cursor_position_callback(NULL, 320.0 + (i & 1), 240.0 - (i & 1));
+            stopBenchmarkTimer();
+            benchmarkSink = benchmarkSink + cameraPosition.x;
+            isOrbiting = isPanning = false;
+        } });
+    }
+}
+
+// View and projection setup plus each object's MVP and normal matrix
+void addMatrixCases()
+{
+    for (int objectCount : { 1, 16, 256, 4096 })
+    {
+        benchmarkCases.push_back({ "matrices/" + std::to_string(objectCount), (double)objectCount, [objectCount](int iterations) {
+            std::vector<glm::mat4> models(objectCount);
+            for (int i = 0; i < objectCount; ++i)
+                models[i] = glm::translate(glm::mat4(1.0f), glm::vec3(i % 16, 0.0f, i / 16));
+            initCamera();
+            width = 800;
+            height = 600;
+
+            glm::mat4 view, projection;
+            startBenchmarkTimer();
+            for (int i = 0; i < iterations; ++i)
+            {
+                computeCameraMatrices(view, projection);
+                glm::mat4 viewProjection = projection * view;
+                float sum = 0.0f;
+                for (const glm::mat4& model : models)
+                {
+                    glm::mat4 mvp = viewProjection * model;
+                    glm::mat3 normalMatrix = glm::mat3(glm::transpose(glm::inverse(model)));
+                    sum += mvp[3][2] + normalMatrix[1][1];
+                }
+                benchmarkSink = benchmarkSink + sum;
+            }
+            stopBenchmarkTimer();
+        } });
+    }
+}
+
+// A wall occluder with a grid of small spheres half behind it, seen from the default camera
+void buildCullingScene(int objectCount)
+{
+    sceneObjects.clear();
+    sceneObjects.push_back({ "wall", 0, 6, 0, 0, glm::mat4(1.0f), glm::vec3(-2.0f, 0.0f, 0.0f), glm::vec3(2.0f, 2.0f, 0.0f), true,
+        benchmarkWallVertices, benchmarkWallIndices, 6, false, -1, 0, 0, glm::vec4(0.0f), true, true });
+    int side = (int)ceilf(sqrtf((float)objectCount));
+    for (int i = 0; i < objectCount; ++i)
+    {
+        glm::vec3 position(-4.0f + 8.0f * (i % side) / side, 0.3f + 1.4f * (i / side) / side, -2.0f);
+        sceneObjects.push_back({ "sphere", 0, 0, 0, 2, glm::translate(glm::mat4(1.0f), position), glm::vec3(-0.1f), glm::vec3(0.1f), false,
+            NULL, NULL, 0, true, primitiveSphere, sphereSegments, sphereRings, glm::vec4(0.1f, 0.0f, 0.0f, 0.0f), true, true });
+    }
+
+    initCamera();
+    width = 800;
+    height = 600;
+}
+
+// Occlusion culling for one camera, then the per-frame view setup plus culling for each of several views
+void addCullingCases()
+{
+    for (int objectCount : { 16, 256, 4096 })
+    {
+        benchmarkCases.push_back({ "culling/occlusion/" + std::to_string(objectCount), (double)objectCount, [objectCount](int iterations) {
+            buildCullingScene(objectCount);
+            glm::mat4 view, projection;
+            computeCameraMatrices(view, projection);
+            startBenchmarkTimer();
+            for (int i = 0; i < iterations; ++i)
+            {
+                cullOccludedObjects(projection * view);
+                benchmarkSink = benchmarkSink + (float)occludedObjectCount;
+            }
+            stopBenchmarkTimer();
+            sceneObjects.clear();
+        } });
+    }
+
+    for (int viewCount : { 1, 2, 4 })
+    {
+        benchmarkCases.push_back({ "culling/views/" + std::to_string(viewCount), 256.0 * viewCount, [viewCount](int iterations) {
+            buildCullingScene(256);
+            multiViewEnabled = true;
+            multiViewTypes = std::vector<int>({ viewPerspective, viewTop, viewFront, viewSide });
+            multiViewTypes.resize(viewCount);
+            startBenchmarkTimer();
+            for (int i = 0; i < iterations; ++i)
+            {
+                computeRenderViews();
+                for (const ViewData& data : viewData)
+                {
+                    cullOccludedObjects(data.projection * data.view);
+                    benchmarkSink = benchmarkSink + (float)occludedObjectCount;
+                }
+            }
+            stopBenchmarkTimer();
+            multiViewEnabled = false;
+            sceneObjects.clear();
+        } });
+    }
+}
+
+// Nearest-first sort of the terrain load area at a few residency budgets
+void addSortCases()
+{
+    // Items are the chunks in the load radius; all are scanned, only the nearest maxCount get sorted
+    std::vector<std::pair<int, long long>> area;
+    collectWantedTerrainChunks(0, 0, 1 << 30, area);
+    double areaChunks = (double)area.size();
+
+    for (int maxCount : { 16, 112, 1024 })
+    {
+        benchmarkCases.push_back({ "sort/terrain_wanted_chunks/" + std::to_string(maxCount), areaChunks, [maxCount](int iterations) {
+            std::vector<std::pair<int, long long>> wanted;
+            startBenchmarkTimer();
+            for (int i = 0; i < iterations; ++i)
+            {
+                collectWantedTerrainChunks(i & 63, i >> 6 & 63, maxCount, wanted);
+                benchmarkSink = benchmarkSink + (float)wanted.size();
+            }
+            stopBenchmarkTimer();
+        } });
+    }
+
+    benchmarkCases.push_back({ "terrain/generate_chunk", (terrainChunkQuads + 1.0) * (terrainChunkQuads + 1.0), [](int iterations) {
+        std::vector<GLfloat> vertices;
+        startBenchmarkTimer();
+        for (int i = 0; i < iterations; ++i)
+        {
+            generateTerrainChunk(i & 15, i >> 4 & 15, vertices);
+            benchmarkSink = benchmarkSink + vertices[1];
+        }
+        stopBenchmarkTimer();
+    } });
+}
+
+// The SSE particle step, on one thread and across the pool, writing to plain memory instead of a mapped buffer
+void addParticleCases()
+{
+    for (int pooled = 0; pooled < 2; ++pooled)
+    {
+        for (int count : { 65536, maxParticles })
+        {
+            std::string name = std::string(pooled ? "particles/simulate_pool/" : "particles/simulate/") + std::to_string(count);
+            benchmarkCases.push_back({ name, (double)count, [count, pooled](int iterations) {
+                for (std::vector<float>* array : { &particlePositionX, &particlePositionY, &particlePositionZ, &particleVelocityX,
+                         &particleVelocityY, &particleVelocityZ, &particleAge, &particleMaterial })
+                    array->assign(maxParticles, 0.0f);
+                std::fill(particlePositionY.begin(), particlePositionY.end(), 2.0f);
+                std::fill(particleVelocityX.begin(), particleVelocityX.end(), 1.0f);
+                particleHead = 0;
+                particleCount = count;
+
+                std::vector<float> instances((size_t)count * 4);
+                startBenchmarkTimer();
+                for (int i = 0; i < iterations; ++i)
+                {
+                    if (pooled)
+                    {
+                        int batchCount = (count + particleBatchSize - 1) / particleBatchSize;
+                        parallelFor(batchCount, [&](int batch) {
+                            simulateParticleBatch(batch * particleBatchSize, std::min((batch + 1) * particleBatchSize, count), 1.0f / 60.0f, instances.data());
+                        });
+                    }
+                    else
+                        simulateParticleBatch(0, count, 1.0f / 60.0f, instances.data());
+                    benchmarkSink = benchmarkSink + instances[1];
+                }
+                stopBenchmarkTimer();
+                particleCount = 0;
+            } });
+        }
+    }
+}
+
+// Time one case, doubling the iterations until a run is long enough to trust
+void runBenchmark(const BenchmarkCase& benchmark, bool first)
+{
+    benchmark.run(1);
+
+    int iterations = 1;
+    double seconds = 0.0;
+    long long allocations = 0;
+    for (;;)
+    {
+        benchmark.run(iterations);
+        seconds = std::chrono::duration<double>(benchmarkStopTime - benchmarkStartTime).count();
+        allocations = benchmarkAllocations;
+        if (seconds >= minBenchmarkSeconds || iterations >= (1 << 30))
+            break;
+
+        // Jump close to the target, but at most 10x so a noisy first run can't overshoot wildly
+        double scale = seconds > 0.0 ? minBenchmarkSeconds * 1.2 / seconds : 10.0;
+        iterations = (int)std::min((double)iterations * std::min(std::max(scale, 2.0), 10.0), (double)(1 << 30));
+    }
+
+    printf("%s    {\"name\": \"%s\", \"iterations\": %d, \"ns_per_op\": %.3f, \"items_per_second\": %.1f, \"allocations_per_op\": %.3f}",
+        first ? "" : ",\n", benchmark.name.c_str(), iterations, seconds * 1e9 / iterations,
+        benchmark.itemsPerOp * iterations / seconds, (double)allocations / iterations);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    const char* filter = argc > 1 ? argv[1] : "";
+
+    initWorkers();
+    initOcclusionCulling();
+
+    addMeshCases();
+    addCameraCases();
+    addMatrixCases();
+    addCullingCases();
+    addSortCases();
+    addParticleCases();
+
+    printf("{\n  \"context\": {\"threads\": %d, \"min_time_s\": %.2f},\n  \"benchmarks\": [\n",
+        (int)workerThreads.size() + 1, minBenchmarkSeconds);
+    bool first = true;
+    for (const BenchmarkCase& benchmark : benchmarkCases)
+    {
+        if (benchmark.name.find(filter) == std::string::npos)
+            continue;
+        runBenchmark(benchmark, first);
+        first = false;
+    }
+    printf("\n  ]\n}\n");
+
+    shutdownWorkers();
+    return 0;
+}
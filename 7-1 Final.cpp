@@ -6,6 +6,33 @@
 #include <glm/glm/gtc/type_ptr.hpp>
 #include <SOIL2/SOIL2.h>
 #include <glm/glm/gtc/constants.hpp>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <ctime>
+#include <cstdio>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <emmintrin.h>
+#include <cfloat>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <timeapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "winmm.lib")
+#endif
+#else
+#include <time.h>
+#endif
 
 using namespace std;
 
@@ -43,8 +70,11 @@ glm::vec3 cameraFront = glm::normalize(glm::vec3(0.f, 0.f, -1.f));
 // Declare target prototype
 glm::vec3 getTarget();
 
-// Camera transformation prototype
-void transformCamera();
+// Camera transformation prototype, returns true if the camera moved
+bool transformCamera();
+
+// View and projection for the current camera
+void computeCameraMatrices(glm::mat4& view, glm::mat4& projection);
 
 // Boolean for keys and mouse buttons
 bool keys[1024], mouseButtons[3];
@@ -62,8 +92,501 @@ bool firstMouseMove = true; // detect initial mouse movement
 
 void initCamera();
 
+// Worker pool shared by the CPU-side stages (occlusion raster, ...)
+std::vector<std::thread> workerThreads;
+std::mutex workerMutex;
+std::condition_variable workerWake, workerDone;
+std::function<void(int)> workerJob;
+std::atomic<int> workerNextTask(0);
+int workerTaskCount = 0, workerFinished = 0;
+unsigned workerGeneration = 0;
+bool workerQuit = false;
+
+// Worker pool prototypes
+void initWorkers();
+void parallelFor(int taskCount, const std::function<void(int)>& job);
+void shutdownWorkers();
+
+// Scene object with its draw state and local-space bounds
+struct SceneObject
+{
+    const char* name;
+    GLuint vao;
+    GLsizei indexCount;
+    GLuint texture;  // Separate texture, used when the material array is off
+    int material;    // Index into materials
+    glm::mat4 model;
+    glm::vec3 boundsMin, boundsMax;
+
+    // Occluders are rasterized into the CPU depth buffer instead of being tested
+    bool isOccluder;
+
+    // CPU copy of the mesh (8 floats per vertex) for the occlusion raster and lightmap bake
+    const GLfloat* meshVertices;
+    const GLuint* meshIndices;
+    int meshIndexCount;
+    bool hasVertexNormals; // Otherwise attribute 1 is a color and face normals are used
+
+    // Torus, cylinder or sphere that can be rebuilt in the vertex shader (-1 if buffered only)
+    int primitiveType;
+    int segments, rings;
+    glm::vec4 shape; // radius, tube radius or height, y offset
+
+    bool visible;
+    bool enabled; // Disabled objects are neither drawn nor rasterized as occluders
+};
+
+std::vector<SceneObject> sceneObjects;
+
+// Occlusion culling settings
+bool occlusionCullingEnabled = true;
+const int occlusionWidth = 256;
+const int occlusionHeight = 192;
+const int occlusionBands = 16; // Horizontal strips rasterized in parallel
+const int maxHiZLevels = 10;
+
+// CPU depth buffer and its min/max pyramid (level 0 is the depth buffer itself)
+float occlusionDepth[occlusionWidth * occlusionHeight];
+std::vector<float> hiZMin[maxHiZLevels], hiZMax[maxHiZLevels];
+int hiZWidth[maxHiZLevels], hiZHeight[maxHiZLevels];
+int hiZLevelCount = 0;
+
+// Occlusion culling stats
+int occludedObjectCount = 0;
+double occlusionCullingMs = 0.0;
+
+// Frame stats are printed once per report interval
+const double statsInterval = 1.0;
+double lastStatsTime = 0.0;
+int statsFrameCount = 0;
+double occlusionCullingMsTotal = 0.0;
+int occludedObjectTotal = 0;
+
+// Material settings: one texture array and uniform buffer shared by every draw
+bool materialArrayEnabled = true;
+const int maxMaterials = 16;          // Passed to the shaders in shaderPrelude
+const GLuint materialBlockBinding = 1;
+const GLint diffuseTextureUnit = 0, materialTextureUnit = 1;
+
+// Matches the std140 Material struct in the fragment shader
+struct Material
+{
+    glm::vec4 tint;
+    glm::vec4 lighting; // Ambient, specular strength, shininess, texture array layer
+};
+
+std::vector<Material> materials;
+GLuint materialBuffer = 0, materialTextureArray = 0;
+int materialTextureSize = 0;
+
+// Texture binds issued while drawing the current frame
+int textureBindCount = 0;
+long long textureBindTotal = 0;
+
+// Material prototypes
+void resampleImage(const unsigned char* source, int sourceWidth, int sourceHeight, unsigned char* destination, int size);
+void initMaterials(unsigned char* const* images, const int* imageWidths, const int* imageHeights, int imageCount);
+void useMaterials(GLuint program);
+void bindMaterialArray();
+
+// Procedural primitive settings
+bool proceduralPrimitivesEnabled = true;
+const int maxProceduralInstances = 16; // Passed to the shaders in shaderPrelude as maxInstances
+const int primitiveTorus = 0, primitiveCylinder = 1, primitiveSphere = 2;
+
+// Procedural primitive state; the core profile needs a VAO bound even without attributes
+GLuint proceduralVAO = 0;
+GLsizeiptr bufferedPrimitiveBytes = 0;
+int primitiveTriangleCount = 0;
+std::vector<char> proceduralBatched; // Per scene object, reused across draws so batching doesn't allocate
+
+// Procedural primitive prototypes
+void drawSceneObject(const SceneObject& object, GLuint program);
+void drawProceduralPrimitives(GLuint program);
+void changeProceduralTessellation(float factor);
+void beginPrimitiveTiming();
+void endPrimitiveTiming();
+
+// Dynamic resolution settings
+bool dynamicResolutionEnabled = true;
+float targetFrameMs = 16.6f;
+float minResolutionScale = 0.5f;
+float maxResolutionScale = 1.0f;
+GLenum upscaleFilter = GL_LINEAR;
+const int resolutionAdjustFrames = 8; // Frames between scale changes
+const int gpuTimerQueryCount = 4;     // Results are read this many frames late to avoid stalls
+
+// Offscreen scene target, allocated at the maximum scale of the window size
+GLuint sceneFramebuffer = 0, sceneColorTexture = 0, sceneDepthBuffer = 0;
+int sceneFramebufferWidth = 0, sceneFramebufferHeight = 0;
+float resolutionScale = 1.0f;
+int renderWidth = 0, renderHeight = 0;
+
+// GPU frame timing, plus timestamps around the primitive draws
+GLuint gpuTimerQueries[gpuTimerQueryCount];
+GLuint primitiveTimestampQueries[gpuTimerQueryCount][2];
+bool primitiveTimingIssued[gpuTimerQueryCount] = {}; // Only frames that drew the lit primitives stamp their slot
+double primitiveGpuMsTotal = 0.0;
+int primitiveGpuSamples = 0;
+int gpuTimerFrame = 0;
+float gpuFrameMs = 0.0f;
+int framesSinceResolutionChange = 0;
+double gpuFrameMsTotal = 0.0;
+int gpuFrameSamples = 0;
+
+// Dynamic resolution prototypes
+void initDynamicResolution();
+void resizeSceneFramebuffer();
+void beginSceneFrame();
+void endSceneFrame();
+
+// Lazy rendering settings: block on events and skip redraws while nothing changes
+bool lazyRenderingEnabled = true;
+const double idleWaitTimeout = 0.25; // Seconds, so the stats keep reporting while idle
+
+// Set by input callbacks and scene changes, cleared once a frame is drawn
+bool inputReceived = true;
+bool sceneDirty = true;
+bool presentRequested = false; // Window contents were damaged and need the last frame again
+
+// Lazy rendering stats
+int skippedFrameCount = 0, representedFrameCount = 0;
+double lastStatsCpuSeconds = 0.0;
+
+// Lazy rendering prototypes
+void window_refresh_callback(GLFWwindow* window);
+void presentPreviousFrame();
+double processCpuSeconds();
+
+// Lightmap settings: static objects can swap per-fragment lighting for baked direct light and AO
+bool lightmapsEnabled = false;
+const int lightmapCellTexels = 8;    // Each quad (triangle pair) gets a cell this size in the atlas
+const int aoSampleCount = 32;
+const float aoMaxDistance = 0.5f;
+const GLint lightmapTextureUnit = 2;
+
+// World-space triangle with per-vertex normals; triangle i bakes into half of atlas cell i / 2
+struct BakeTriangle
+{
+    glm::vec3 position[3];
+    glm::vec3 normal[3];
+};
+
+// BVH node: leaves hold count triangles of bvhTriangleOrder from first; inner nodes have count 0
+// and their children at first and first + 1
+struct BvhNode
+{
+    glm::vec3 boundsMin, boundsMax;
+    int first, count;
+};
+
+std::vector<BakeTriangle> bakeTriangles;
+std::vector<int> bvhTriangleOrder;
+std::vector<BvhNode> bvhNodes;
+
+// One atlas for every static object, plus an expanded VAO per object with lightmap UVs
+struct ObjectLightmap
+{
+    GLuint vao, vbo;
+    GLsizei vertexCount;
+    int firstTriangle;
+};
+
+std::vector<ObjectLightmap> objectLightmaps; // Parallel to sceneObjects
+GLuint lightmapTexture = 0;
+int lightmapCellsPerRow = 0, lightmapSize = 0;
+bool lightmapsBaked = false;
+int lightmapBakeRequest = 0; // 1 bakes on the worker pool, 2 on this thread only
+double lightmapBakeMs = 0.0;
+
+// Lightmap prototypes
+void buildLightmapMeshes();
+void releaseLightmapMeshes();
+void bakeLightmaps(const glm::vec3& lightPos, bool singleThreaded);
+void drawLightmappedObjects(GLuint program);
+
+// Terrain settings: a heightfield streamed in chunks around the camera, replacing the ground plane
+bool terrainEnabled = false;
+const int terrainChunkQuads = 32;       // Power of two; vertex indices must fit GLushort
+const float terrainChunkSize = 4.0f;    // World units per chunk side
+const float terrainHeightScale = 1.5f;
+const int terrainLoadRadius = 8;        // Chunks around the camera that should be resident
+const float terrainLodDistance = 1.5f;  // Chunk sizes per geomipmap level
+const int terrainLodCount = 5;          // Steps 1..16; the coarsest level keeps an inner vertex
+const int terrainLoaderCount = 2;
+const int terrainUploadsPerFrame = 4;
+const int terrainMaxInFlight = 8;       // Requested chunks not yet uploaded
+size_t terrainResidencyBudget = 4 * 1024 * 1024; // Resident plus in-flight vertex bytes; the load radius wants ~6.5 MB
+const int planeObjectIndex = 1;         // The ground plane in sceneObjects, hidden while the terrain is on
+
+// Resident chunk; every chunk VAO shares the LOD index buffer
+struct TerrainChunk
+{
+    int x, z;
+    GLuint vao, vbo;
+    int lod;
+};
+
+// Vertices generated off the main thread, waiting for upload
+struct TerrainChunkData
+{
+    int x, z;
+    std::vector<GLfloat> vertices;
+};
+
+std::unordered_map<long long, TerrainChunk> terrainChunks;
+std::unordered_set<long long> terrainInFlight;
+std::vector<std::pair<GLuint, GLuint>> terrainFreeBuffers; // VAO and VBO pairs from evicted chunks
+
+// One index buffer holding, per LOD, a variant for each mask of coarser neighbours (-Z, +Z, -X, +X)
+GLuint terrainIndexBuffer = 0;
+GLsizei terrainIndexOffset[terrainLodCount][16], terrainIndexCount[terrainLodCount][16];
+
+// Loader threads and their queues
+std::vector<std::thread> terrainLoaders;
+std::mutex terrainMutex;
+std::condition_variable terrainWake;
+std::deque<std::pair<int, int>> terrainRequests;
+std::vector<TerrainChunkData> terrainLoaded;
+bool terrainLoaderQuit = false;
+
+// Terrain stats
+int terrainEvictionCount = 0, terrainUploadCount = 0, terrainTriangleCount = 0;
+
+// Terrain prototypes
+float terrainHeight(float x, float z);
+void initTerrain();
+void collectWantedTerrainChunks(int centerX, int centerZ, int maxCount, std::vector<std::pair<int, long long>>& wanted);
+void updateTerrain(const glm::vec3& center);
+void drawTerrain(GLuint program);
+void shutdownTerrain();
+
+// Particle settings: SoA particles simulated with SSE on the worker pool and streamed to the GPU each frame
+bool particlesEnabled = false;
+const int maxParticles = 1 << 20;       // Multiple of particleBatchSize
+const int particleBatchSize = 16384;    // Particles per worker task, a multiple of 4
+float particleEmitRate = 250000.0f;     // Particles per second across every emitter
+float particleLifetime = 4.0f;          // Shared by every particle, so they die in emission order
+const glm::vec3 particleGravity(0.0f, -9.8f, 0.0f);
+float particleDrag = 0.5f;              // Velocity lost per second
+float particleRestitution = 0.4f;       // Vertical speed kept when bouncing off the ground
+float particleFriction = 0.8f;          // Horizontal speed kept per bounce
+const float particleGroundHeight = 0.6f; // Top of the ground plane; the y = 0.3 face in the box mesh is never drawn
+const float particleGroundHalfSize = 2.0f; // The plane covers x and z in [-2, 2]; particles past it fall until they expire
+const int particleTerrainCells = 128;   // Cached terrain heights for collision, one per terrain vertex
+const float particleTerrainExtent = 8.0f; // Half size of the cached area; further out the heightfield is sampled directly
+float particleSize = 0.02f;             // Billboard half size in world units at birth
+const int particleRingSections = 3;     // Frames of instance data in flight
+
+// Fountain that emits a cone of particles textured with one of the materials
+struct ParticleEmitter
+{
+    glm::vec3 position;
+    glm::vec3 velocity;
+    float spread; // Random speed added on each axis
+    int material;
+};
+
+std::vector<ParticleEmitter> particleEmitters;
+
+// Live particles are the ring [particleHead, particleHead + particleCount), both kept multiples of 4
+std::vector<float> particlePositionX, particlePositionY, particlePositionZ;
+std::vector<float> particleVelocityX, particleVelocityY, particleVelocityZ;
+std::vector<float> particleAge, particleMaterial;
+int particleHead = 0, particleCount = 0;
+float particleEmitCarry = 0.0f;
+unsigned int particleSeed = 12345;
+std::vector<float> particleTerrainHeights; // (particleTerrainCells + 1)^2 samples of terrainHeight
+
+// Instance ring: one section per frame, written unsynchronized once its fence signals
+GLuint particleVAO = 0, particleBuffer = 0;
+GLsync particleFences[particleRingSections];
+int particleSection = 0;
+GLsizeiptr particleSectionBytes = 0;
+int particleDrawCount = 0;
+
+// Particle stats
+double particleSimulationMsTotal = 0.0;
+long long particleSimulatedTotal = 0, particleUploadBytesTotal = 0;
+int particleOrphanCount = 0;
+
+// Particle prototypes
+void initParticles();
+void initParticleTerrain();
+float particleTerrainHeight(float x, float z);
+void updateParticles(float deltaTime);
+void drawParticles(GLuint program);
+void shutdownParticles();
+
+// Multi-view settings: several cameras drawn into a grid of sub-rectangles of one frame
+bool multiViewEnabled = false;
+const int maxViews = 8;                    // Passed to the shaders in shaderPrelude
+const int viewPerspective = 0, viewOrthographic = 1, viewTop = 2, viewFront = 3, viewSide = 4;
+std::vector<int> multiViewTypes = { viewPerspective, viewTop, viewFront, viewSide };
+const glm::vec3 multiViewCenter(0.0f, 0.8f, 0.0f);  // The axis views look at the middle of the objects
+const float multiViewExtent = 2.5f;        // Half height of the orthographic views
+const GLuint viewBlockBinding = 2;
+
+// Matches the std140 View struct in the shaders
+struct ViewData
+{
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec4 position; // Eye position for the specular term
+};
+
+// This frame's views and their viewports as fractions of the render target (x, y, width, height)
+std::vector<ViewData> viewData;
+std::vector<glm::vec4> viewRects;
+GLuint viewBuffer = 0;
+
+// Multi-view stats
+double viewCullingMsTotal = 0.0;
+long long viewTotal = 0;
+
+// Multi-view prototypes
+void computeViewMatrices(int type, float aspect, ViewData& data);
+void computeRenderViews();
+void initViews();
+void uploadRenderViews();
+void beginView(int viewIndex);
+void useView(GLuint program, int viewIndex);
+
+// Frame pacing settings: swap interval, an optional frame limiter and input-to-present latency tracking
+int swapInterval = 1;                 // 0 presents immediately, 1 waits for vertical blank
+double frameLimitFps = 0.0;           // 0 leaves pacing to the swap interval
+#ifdef _WIN32
+const double frameLimiterSpinMs = 3.0; // Sleep until this close to the deadline, then spin; sleeps are ~1 ms late even at 1 ms timer resolution
+#else
+const double frameLimiterSpinMs = 2.0; // Sleep until this close to the deadline, then spin for precision
+#endif
+bool lateInputSampling = true;        // Poll input right before rendering instead of right after the swap
+const int maxLatencyFramesInFlight = 8;
+const size_t maxPendingInputs = 256;
+const double latencyPollInterval = 0.001; // Idle wake-up while a present fence is pending, in seconds
+
+// Frame submitted with the callback times of the inputs it shows, until its fence signals
+struct LatencyFrame
+{
+    GLsync fence;
+    double submitTime;
+    std::vector<double> inputTimes;
+};
+
+std::vector<double> pendingInputTimes; // Inputs received but not drawn yet
+std::deque<LatencyFrame> latencyFrames;
+double nextFrameDeadline = 0.0, lastSwapTime = 0.0;
+
+// Frame pacing stats, in milliseconds
+std::vector<double> inputToSubmitMs, inputToPresentMs, frameIntervalMs;
+
+// Frame pacing prototypes
+void initFramePacing();
+void recordInput();
+void limitFrameRate();
+void submitLatencyFrame(double submitTime);
+void collectPresentedFrames();
+void shutdownFramePacing();
+
+// Frame capture settings: frames are read back through a ring of PBOs and written on a thread
+bool frameCaptureEnabled = false;
+bool captureAsImageSequence = false;  // Raw RGB stream keeps up with 1080p; PPM files are easier to inspect
+const char* captureRawPattern = "capture_%s_%02d_%dx%d"; // Start time, file number and frame size; .rgb plus a .txt sidecar
+const char* captureImagePattern = "capture_%05lld.ppm";
+const int captureRingSize = 3;        // Each readback is mapped this many frames later
+const int maxQueuedCaptureFrames = 8; // Frames beyond this are dropped instead of stalling
+
+// Readback slot, pending until its fence signals
+struct CaptureSlot
+{
+    GLuint pbo;
+    GLsizeiptr size;
+    GLsync fence;
+    int width, height;
+    long long frameIndex;
+    int session;
+    double issueTime;
+};
+
+// Frame handed to the writer thread, BGRA and bottom-up as read from GL
+struct CapturedFrame
+{
+    std::vector<unsigned char> pixels;
+    int width, height;
+    long long frameIndex;
+    int session;
+};
+
+CaptureSlot captureSlots[captureRingSize];
+int captureNextSlot = 0;
+long long drawnFrameIndex = 0;
+int captureSession = 0; // Bumped each time capture starts, so every session gets its own raw file
+
+// Writer thread state; pixel buffers are recycled through captureFreeBuffers
+std::thread captureWriter;
+std::mutex captureMutex;
+std::condition_variable captureReady;
+std::deque<CapturedFrame> captureQueue;
+std::vector<std::vector<unsigned char>> captureFreeBuffers;
+bool captureWriterQuit = false;
+
+// Frame capture stats
+int capturedFrameCount = 0, droppedCaptureFrameCount = 0;
+double captureLatencyMsTotal = 0.0;
+long long captureLatencyFramesTotal = 0;
+
+// Frame capture prototypes
+FILE* openCaptureFile(const char* path, const char* mode);
+void formatCaptureTime(char* buffer, size_t size);
+void initFrameCapture();
+void captureFrame();
+void collectCapturedFrames();
+void shutdownFrameCapture();
+
+// Occlusion culling prototypes
+void initOcclusionCulling();
+void cullOccludedObjects(const glm::mat4& viewProjection);
+void recordFrameStats();
+void printFrameStats(double currentTime);
+
+// Declarations shared by every shader stage, sized from the C++ limits; compiled ahead of each stage's source
+std::string shaderPrelude()
+{
+    return "#version 330 core\n"
+        "const int maxMaterials = " + std::to_string(maxMaterials) + ";\n"
+        "const int maxViews = " + std::to_string(maxViews) + ";\n"
+        "const int maxInstances = " + std::to_string(maxProceduralInstances) + ";\n"
+        R"(
+    // Per-material tint and lighting; lighting is ambient, specular strength, shininess, array layer
+    struct Material
+    {
+        vec4 tint;
+        vec4 lighting;
+    };
+
+    layout(std140) uniform Materials
+    {
+        Material materials[maxMaterials];
+    };
+
+    // Camera of each viewport; viewIndex picks the one being drawn
+    struct View
+    {
+        mat4 view;
+        mat4 projection;
+        vec4 position;
+    };
+
+    layout(std140) uniform Views
+    {
+        View views[maxViews];
+    };
+
+    uniform int viewIndex;
+)";
+}
+
 const char* vertexShaderSource = R"(
-    #version 330 core
     layout(location = 0) in vec3 vPosition;
     layout(location = 1) in vec3 aColor;
     layout(location = 2) in vec2 texCoord;
@@ -71,16 +594,82 @@ const char* vertexShaderSource = R"(
     out vec3 Normal;  // Pass the normal to the fragment shader
     out vec3 oColor;
     out vec2 oTexCoord;
+    flat out int oMaterial;
     uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    uniform int materialIndex;
+
     void main()
     {
+        mat4 view = views[viewIndex].view;
+        mat4 projection = views[viewIndex].projection;
         gl_Position = projection * view * model * vec4(vPosition, 1.0);
         FragPos = vec3(model * vec4(vPosition, 1.0));
         Normal = mat3(transpose(inverse(model))) * aColor; // Transform normal to world space
         oColor = aColor;
         oTexCoord = texCoord;
+        oMaterial = materialIndex;
+    }
+)";
+
+// Rebuilds torus, cylinder and sphere vertices from gl_VertexID, so these need no buffers.
+// Each quad of the segments x rings grid is two triangles in the same order as the
+// generate*VerticesAndIndices index buffers; instances share the tessellation of the draw.
+const char* proceduralVertexShaderSource = R"(
+    const float PI = 3.14159265;
+    out vec3 FragPos;
+    out vec3 Normal;
+    out vec3 oColor;
+    out vec2 oTexCoord;
+    flat out int oMaterial;
+    uniform int primitiveType;   // 0 torus, 1 cylinder, 2 sphere
+    uniform ivec2 tessellation;  // segments, rings
+    uniform mat4 instanceModel[maxInstances];
+    uniform vec4 instanceShape[maxInstances]; // radius, tube radius or height, y offset
+    uniform int instanceMaterial[maxInstances];
+
+    void main()
+    {
+        mat4 view = views[viewIndex].view;
+        mat4 projection = views[viewIndex].projection;
+        const int cornerI[6] = int[6](0, 1, 1, 1, 0, 0);
+        const int cornerJ[6] = int[6](0, 0, 1, 1, 1, 0);
+        int quad = gl_VertexID / 6;
+        int corner = gl_VertexID % 6;
+        int i = quad / tessellation.y + cornerI[corner];
+        int j = quad % tessellation.y + cornerJ[corner];
+        float u = float(i) / float(tessellation.x);
+        float v = float(j) / float(tessellation.y);
+        vec4 shape = instanceShape[gl_InstanceID];
+        float theta = 2.0 * PI * u;
+
+        vec3 position, normal;
+        vec2 uv = vec2(1.0 - u, 1.0 - v);
+        if (primitiveType == 0)
+        {
+            float phi = 2.0 * PI * v;
+            normal = vec3(cos(phi) * cos(theta), sin(phi), cos(phi) * sin(theta));
+            position = vec3((shape.x + shape.y * cos(phi)) * cos(theta), shape.y * sin(phi) + shape.z, (shape.x + shape.y * cos(phi)) * sin(theta));
+        }
+        else if (primitiveType == 1)
+        {
+            normal = vec3(cos(theta), 0.0, sin(theta));
+            position = vec3(shape.x * cos(theta), shape.y * (0.5 - v), shape.x * sin(theta));
+            uv.y = 0.5;
+        }
+        else
+        {
+            float phi = PI * v;
+            normal = vec3(sin(phi) * cos(theta), cos(phi), sin(phi) * sin(theta));
+            position = shape.x * normal;
+        }
+
+        mat4 model = instanceModel[gl_InstanceID];
+        gl_Position = projection * view * model * vec4(position, 1.0);
+        FragPos = vec3(model * vec4(position, 1.0));
+        Normal = mat3(transpose(inverse(model))) * normal;
+        oColor = normal;
+        oTexCoord = uv;
+        oMaterial = instanceMaterial[gl_InstanceID];
     }
 )";
 
@@ -89,18 +678,35 @@ const char* fragmentShaderSource = R"(
         in vec3 Normal;
         in vec3 oColor;
         in vec2 oTexCoord;
+        flat in int oMaterial;
 
         out vec4 fragColor;
 
         uniform sampler2D diffuseTexture;
+        uniform sampler2DArray materialTextures;
+        uniform bool useMaterialArray;
         uniform vec3 lightPos;
-        uniform vec3 viewPos;
         uniform vec3 lightColor;
 
         void main()
         {
-            // Ambient lighting
+            vec3 viewPos = views[viewIndex].position.xyz;
             float ambientStrength = 0.5;
+            float specularStrength = 6.5;
+            float shininess = 128.0;
+            vec4 albedo;
+            if (useMaterialArray)
+            {
+                Material material = materials[oMaterial];
+                ambientStrength = material.lighting.x;
+                specularStrength = material.lighting.y;
+                shininess = material.lighting.z;
+                albedo = texture(materialTextures, vec3(oTexCoord, material.lighting.w)) * material.tint;
+            }
+            else
+                albedo = texture(diffuseTexture, oTexCoord);
+
+            // Ambient lighting
             vec3 ambient = ambientStrength * lightColor;
 
             // Diffuse lighting
@@ -110,203 +716,2581 @@ const char* fragmentShaderSource = R"(
             vec3 diffuse = diff * lightColor;
 
             // Specular lighting
-            float specularStrength = 6.5;
             vec3 viewDir = normalize(viewPos - FragPos);
             vec3 reflectDir = reflect(-lightDir, norm);
-            float spec = pow(max(dot(viewDir, reflectDir), 0.0), 128);
+            float spec = pow(max(dot(viewDir, reflectDir), 0.0), shininess);
             vec3 specular = specularStrength * spec * lightColor;
 
             // Combine ambient, diffuse, and specular
             vec3 result = (ambient + diffuse + specular);
 
             // Use the texture color without multiplying by oColor
-            fragColor = texture(diffuseTexture, oTexCoord) * vec4(result, 1.0);
+            fragColor = albedo * vec4(result, 1.0);
         }
     
 )";
 
-void framebuffer_size_callback(GLFWwindow* window, int width, int height)
+// Static objects with baked lighting: albedo times the lightmap, no per-fragment lighting
+const char* lightmapVertexShaderSource = R"(
+    layout(location = 0) in vec3 vPosition;
+    layout(location = 2) in vec2 texCoord;
+    layout(location = 3) in vec2 lightmapCoord;
+    out vec2 oTexCoord;
+    out vec2 oLightmapCoord;
+    flat out int oMaterial;
+    uniform mat4 model;
+    uniform int materialIndex;
+
+    void main()
+    {
+        mat4 view = views[viewIndex].view;
+        mat4 projection = views[viewIndex].projection;
+        gl_Position = projection * view * model * vec4(vPosition, 1.0);
+        oTexCoord = texCoord;
+        oLightmapCoord = lightmapCoord;
+        oMaterial = materialIndex;
+    }
+)";
+
+const char* lightmapFragmentShaderSource = R"(
+    in vec2 oTexCoord;
+    in vec2 oLightmapCoord;
+    flat in int oMaterial;
+    out vec4 fragColor;
+
+    uniform sampler2D diffuseTexture;
+    uniform sampler2DArray materialTextures;
+    uniform sampler2D lightmap;
+    uniform bool useMaterialArray;
+    void main()
+    {
+        // Same ambient strength as the live lighting, applied to the baked occlusion
+        float ambientStrength = 0.5;
+        vec4 albedo;
+        if (useMaterialArray)
+        {
+            ambientStrength = materials[oMaterial].lighting.x;
+            albedo = texture(materialTextures, vec3(oTexCoord, materials[oMaterial].lighting.w)) * materials[oMaterial].tint;
+        }
+        else
+            albedo = texture(diffuseTexture, oTexCoord);
+
+        // Red is ambient occlusion, green is shadowed direct diffuse
+        vec2 baked = texture(lightmap, oLightmapCoord).rg;
+        fragColor = albedo * vec4(vec3(ambientStrength * baked.r + baked.g), 1.0);
+    }
+)";
+
+// Camera-facing particle quads, one instance per particle. The instance holds the position and,
+// in w, the material plus the fraction of life used; dead particles still in the ring are negative.
+const char* particleVertexShaderSource = R"(
+    layout(location = 0) in vec4 particle;
+    out vec2 oTexCoord;
+    flat out int oMaterial;
+    uniform float particleSize;
+
+    void main()
+    {
+        mat4 view = views[viewIndex].view;
+        mat4 projection = views[viewIndex].projection;
+        vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+        float size = particle.w < 0.0 ? 0.0 : particleSize * (1.0 - fract(particle.w));
+        vec3 right = vec3(view[0][0], view[1][0], view[2][0]);
+        vec3 up = vec3(view[0][1], view[1][1], view[2][1]);
+        vec3 position = particle.xyz + (right * (corner.x * 2.0 - 1.0) + up * (corner.y * 2.0 - 1.0)) * size;
+        gl_Position = projection * view * vec4(position, 1.0);
+        oTexCoord = corner;
+        oMaterial = int(particle.w);
+    }
+)";
+
+const char* particleFragmentShaderSource = R"(
+    in vec2 oTexCoord;
+    flat in int oMaterial;
+    out vec4 fragColor;
+
+    uniform sampler2DArray materialTextures;
+    void main()
+    {
+        // Round and opaque, so millions of particles need no sorting
+        vec2 offset = oTexCoord * 2.0 - 1.0;
+        if (dot(offset, offset) > 1.0)
+            discard;
+        fragColor = texture(materialTextures, vec3(oTexCoord, materials[oMaterial].lighting.w)) * materials[oMaterial].tint;
+    }
+)";
+
+void framebuffer_size_callback(GLFWwindow* window, int width, int height)
+{
+    glViewport(0, 0, width, height);
+
+    // Keep the window size for the projection and offscreen target
+    ::width = width;
+    ::height = height;
+    resizeSceneFramebuffer();
+    sceneDirty = true;
+}
+
+void window_refresh_callback(GLFWwindow* window)
+{
+    presentRequested = true;
+}
+
+// Block bindings and sampler units are program state, so they are set once after linking
+void bindProgramResources(GLuint program)
+{
+    glUseProgram(program);
+    GLuint blockIndex = glGetUniformBlockIndex(program, "Views");
+    if (blockIndex != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, blockIndex, viewBlockBinding);
+    blockIndex = glGetUniformBlockIndex(program, "Materials");
+    if (blockIndex != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, blockIndex, materialBlockBinding);
+    glUniform1i(glGetUniformLocation(program, "diffuseTexture"), diffuseTextureUnit);
+    glUniform1i(glGetUniformLocation(program, "materialTextures"), materialTextureUnit);
+    glUniform1i(glGetUniformLocation(program, "lightmap"), lightmapTextureUnit);
+    glUseProgram(0);
+}
+
+// Compile and link a shader program after the shared prelude, reporting errors to stderr
+GLuint createShaderProgram(const char* vertexSource, const char* fragmentSource)
+{
+    static const std::string prelude = shaderPrelude();
+    const char* vertexSources[] = { prelude.c_str(), vertexSource };
+    const char* fragmentSources[] = { prelude.c_str(), fragmentSource };
+
+    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertexShader, 2, vertexSources, NULL);
+    glCompileShader(vertexShader);
+
+    GLint success;
+    GLchar infoLog[512];
+    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(vertexShader, sizeof(infoLog), NULL, infoLog);
+        std::cerr << "Vertex shader compilation failed: " << infoLog << std::endl;
+    }
+
+    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragmentShader, 2, fragmentSources, NULL);
+    glCompileShader(fragmentShader);
+
+    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(fragmentShader, sizeof(infoLog), NULL, infoLog);
+        std::cerr << "Fragment shader compilation failed: " << infoLog << std::endl;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    glLinkProgram(program);
+
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(program, sizeof(infoLog), NULL, infoLog);
+        std::cerr << "Shader program linking failed: " << infoLog << std::endl;
+    }
+
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+
+    bindProgramResources(program);
+    return program;
+}
+
+// Upload the per-frame light uniforms
+void setFrameUniforms(GLuint program, const glm::vec3& lightPos, const glm::vec3& lightColor)
+{
+    glUseProgram(program);
+    glUniform3fv(glGetUniformLocation(program, "lightPos"), 1, glm::value_ptr(lightPos));
+    glUniform3fv(glGetUniformLocation(program, "lightColor"), 1, glm::value_ptr(lightColor));
+}
+
+// Vertices and indices for the torus
+const int torusSegments = 20;
+const int torusRings = 10;
+const float torusRadius = 0.25f;
+const float tubeRadius = 0.1f;
+
+GLfloat torusVertices[(torusSegments + 1) * (torusRings + 1) * 8]; // 8 attributes
+GLuint torusIndices[torusSegments * torusRings * 6]; // 6 indices
+
+// Fill (segments + 1) * (rings + 1) vertices and segments * rings quads of a torus at any tessellation
+void generateTorusMesh(int segments, int rings, GLfloat* vertices, GLuint* indices) {
+    int index = 0;
+    for (int i = 0; i <= segments; ++i) {
+        for (int j = 0; j <= rings; ++j) {
+            float u = static_cast<float>(i) / segments;
+            float v = static_cast<float>(j) / rings;
+            float theta = 2.0f * PI * u;
+            float phi = 2.0f * PI * v;
+
+            float x = (torusRadius + tubeRadius * cos(phi) ) * cos(theta);
+            float y = tubeRadius * sin(phi) + 0.7f;
+            float z = (torusRadius + tubeRadius * cos(phi)) * sin(theta);
+
+            float nx = cos(phi) * cos(theta);
+            float ny = sin(phi);
+            float nz = cos(phi) * sin(theta);
+
+            float s = 1.0f - u;
+            float t = 1.0f - v;
+
+            vertices[index++] = x;
+            vertices[index++] = y;
+            vertices[index++] = z;
+            vertices[index++] = nx;
+            vertices[index++] = ny;
+            vertices[index++] = nz;
+            vertices[index++] = s;
+            vertices[index++] = t;
+        }
+    }
+
+    index = 0;
+    for (int i = 0; i < segments; ++i) {
+        for (int j = 0; j < rings; ++j) {
+            int p0 = i * (rings + 1) + j;
+            int p1 = (i + 1) * (rings + 1) + j;
+            int p2 = (i + 1) * (rings + 1) + (j + 1);
+            int p3 = i * (rings + 1) + (j + 1);
+
+            indices[index++] = p0;
+            indices[index++] = p1;
+            indices[index++] = p2;
+            indices[index++] = p2;
+            indices[index++] = p3;
+            indices[index++] = p0;
+        }
+    }
+}
+
+void generateTorusVerticesAndIndices() {
+    generateTorusMesh(torusSegments, torusRings, torusVertices, torusIndices);
+}
+
+// Vertices and indices for the cylinder
+const int cylinderSegments = 20;
+const float cylinderRadius = 0.2f;
+const float cylinderHeight = 0.5f;
+
+GLfloat cylinderVertices[(cylinderSegments + 1) * 2 * 8]; // 8 attributes per vertex
+GLuint cylinderIndices[cylinderSegments * 6]; // 6 indices per quad
+
+// Fill (segments + 1) * 2 vertices and segments quads of an open cylinder at any tessellation
+void generateCylinderMesh(int segments, GLfloat* vertices, GLuint* indices) {
+    int index = 0;
+    for (int i = 0; i <= segments; ++i) {
+        float u = static_cast<float>(i) / segments;
+        float theta = 2.0f * PI * u;
+
+        float x = cylinderRadius * cos(theta);
+        float y = cylinderHeight / 2.0f;
+        float z = cylinderRadius * sin(theta);
+
+        float nx = cos(theta);
+        float ny = 0.0f;
+        float nz = sin(theta);
+
+        float s = 1.0f - u;
+        float t = 0.5f; // You can adjust this for texture mapping
+
+        vertices[index++] = x;
+        vertices[index++] = y;
+        vertices[index++] = z;
+        vertices[index++] = nx;
+        vertices[index++] = ny;
+        vertices[index++] = nz;
+        vertices[index++] = s;
+        vertices[index++] = t;
+
+        vertices[index++] = x;
+        vertices[index++] = -y;
+        vertices[index++] = z;
+        vertices[index++] = nx;
+        vertices[index++] = ny;
+        vertices[index++] = nz;
+        vertices[index++] = s;
+        vertices[index++] = 1.0f - t;
+    }
+
+    index = 0;
+    for (int i = 0; i < segments; ++i) {
+        int p0 = i * 2;
+        int p1 = (i + 1) * 2;
+        int p2 = (i + 1) * 2 + 1;
+        int p3 = i * 2 + 1;
+
+        indices[index++] = p0;
+        indices[index++] = p1;
+        indices[index++] = p2;
+        indices[index++] = p2;
+        indices[index++] = p3;
+        indices[index++] = p0;
+    }
+}
+
+void generateCylinderVerticesAndIndices() {
+    generateCylinderMesh(cylinderSegments, cylinderVertices, cylinderIndices);
+}
+
+// Vertices and indices for the sphere
+const int sphereSegments = 20;
+const int sphereRings = 20;
+const float sphereRadius = 0.3f;
+
+GLfloat sphereVertices[(sphereSegments + 1) * (sphereRings + 1) * 8];
+GLuint sphereIndices[sphereSegments * sphereRings * 6];
+
+// Fill (segments + 1) * (rings + 1) vertices and segments * rings quads of a sphere at any tessellation
+void generateSphereMesh(int segments, int rings, GLfloat* vertices, GLuint* indices) {
+    int index = 0;
+    for (int i = 0; i <= segments; ++i) {
+        for (int j = 0; j <= rings; ++j) {
+            float u = static_cast<float>(i) / segments;
+            float v = static_cast<float>(j) / rings;
+            float theta = 2.0f * glm::pi<float>() * u;
+            float phi = glm::pi<float>() * v;
+
+            float x = sphereRadius * sin(phi) * cos(theta);
+            float y = sphereRadius * cos(phi);
+            float z = sphereRadius * sin(phi) * sin(theta);
+
+            float nx = sin(phi) * cos(theta);
+            float ny = cos(phi);
+            float nz = sin(phi) * sin(theta);
+
+            float s = 1.0f - u;
+            float t = 1.0f - v;
+
+            vertices[index++] = x;
+            vertices[index++] = y;
+            vertices[index++] = z;
+            vertices[index++] = nx;
+            vertices[index++] = ny;
+            vertices[index++] = nz;
+            vertices[index++] = s;
+            vertices[index++] = t;
+        }
+    }
+
+    index = 0;
+    for (int i = 0; i < segments; ++i) {
+        for (int j = 0; j < rings; ++j) {
+            int p0 = i * (rings + 1) + j;
+            int p1 = (i + 1) * (rings + 1) + j;
+            int p2 = (i + 1) * (rings + 1) + (j + 1);
+            int p3 = i * (rings + 1) + (j + 1);
+
+            indices[index++] = p0;
+            indices[index++] = p1;
+            indices[index++] = p2;
+            indices[index++] = p2;
+            indices[index++] = p3;
+            indices[index++] = p0;
+        }
+    }
+}
+
+void generateSphereVerticesAndIndices() {
+    generateSphereMesh(sphereSegments, sphereRings, sphereVertices, sphereIndices);
+}
+
+// Start the worker pool, leaving one core for the render thread
+void initWorkers()
+{
+    unsigned int threadCount = std::thread::hardware_concurrency();
+    if (threadCount < 2)
+        threadCount = 2;
+
+    for (unsigned int i = 0; i < threadCount - 1; ++i)
+    {
+        workerThreads.emplace_back([] {
+            unsigned seenGeneration = 0;
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(workerMutex);
+                    workerWake.wait(lock, [&] { return workerQuit || workerGeneration != seenGeneration; });
+                    if (workerQuit)
+                        return;
+                    seenGeneration = workerGeneration;
+                }
+
+                int task;
+                while ((task = workerNextTask.fetch_add(1)) < workerTaskCount)
+                    workerJob(task);
+
+                {
+                    std::lock_guard<std::mutex> lock(workerMutex);
+                    ++workerFinished;
+                }
+                workerDone.notify_all();
+            }
+        });
+    }
+}
+
+// Run job(0..taskCount-1) across the pool and the calling thread; not reentrant
+void parallelFor(int taskCount, const std::function<void(int)>& job)
+{
+    if (workerThreads.empty() || taskCount <= 1)
+    {
+        for (int i = 0; i < taskCount; ++i)
+            job(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(workerMutex);
+        workerJob = job;
+        workerTaskCount = taskCount;
+        workerNextTask = 0;
+        workerFinished = 0;
+        ++workerGeneration;
+    }
+    workerWake.notify_all();
+
+    int task;
+    while ((task = workerNextTask.fetch_add(1)) < taskCount)
+        job(task);
+
+    // Wait for every worker to check in so none still reads this job
+    std::unique_lock<std::mutex> lock(workerMutex);
+    workerDone.wait(lock, [] { return workerFinished == (int)workerThreads.size(); });
+}
+
+void shutdownWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(workerMutex);
+        workerQuit = true;
+    }
+    workerWake.notify_all();
+    for (std::thread& worker : workerThreads)
+        worker.join();
+    workerThreads.clear();
+}
+
+// Allocate the min/max depth pyramid
+void initOcclusionCulling()
+{
+    int levelWidth = occlusionWidth, levelHeight = occlusionHeight;
+    hiZLevelCount = 0;
+    while (hiZLevelCount < maxHiZLevels)
+    {
+        hiZWidth[hiZLevelCount] = levelWidth;
+        hiZHeight[hiZLevelCount] = levelHeight;
+        hiZMin[hiZLevelCount].assign(levelWidth * levelHeight, 1.0f);
+        hiZMax[hiZLevelCount].assign(levelWidth * levelHeight, 1.0f);
+        ++hiZLevelCount;
+
+        if (levelWidth == 1 && levelHeight == 1)
+            break;
+        levelWidth = (levelWidth + 1) / 2;
+        levelHeight = (levelHeight + 1) / 2;
+    }
+}
+
+// Occluder triangle in occlusion buffer pixels, depth in [0, 1]
+struct OccluderTriangle
+{
+    float x[3], y[3], z[3];
+    int minY, maxY;
+};
+
+std::vector<OccluderTriangle> occluderTriangles;
+
+// Rasterize every occluder triangle overlapping rows [bandMinY, bandMaxY), four pixels at a time
+void rasterizeOccluderBand(int bandMinY, int bandMaxY)
+{
+    for (const OccluderTriangle& tri : occluderTriangles)
+    {
+        int minY = std::max(tri.minY, bandMinY);
+        int maxY = std::min(tri.maxY, bandMaxY - 1);
+        if (minY > maxY)
+            continue;
+
+        float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+        if (fabsf(area) < 1e-6f)
+            continue;
+
+        // Occluders are double sided, so flip clockwise triangles
+        int i1 = 1, i2 = 2;
+        if (area < 0.0f)
+        {
+            i1 = 2;
+            i2 = 1;
+            area = -area;
+        }
+        float x0 = tri.x[0], y0 = tri.y[0], x1 = tri.x[i1], y1 = tri.y[i1], x2 = tri.x[i2], y2 = tri.y[i2];
+        float z0 = tri.z[0], z1 = tri.z[i1], z2 = tri.z[i2];
+
+        int minX = std::max((int)floorf(std::min(x0, std::min(x1, x2))), 0) & ~3;
+        int maxX = std::min((int)ceilf(std::max(x0, std::max(x1, x2))), occlusionWidth - 1);
+
+        // Edge function e(x, y) = a * x + b * y + c, positive inside
+        float a0 = y1 - y2, b0 = x2 - x1, c0 = x1 * y2 - x2 * y1;
+        float a1 = y2 - y0, b1 = x0 - x2, c1 = x2 * y0 - x0 * y2;
+        float a2 = y0 - y1, b2 = x1 - x0, c2 = x0 * y1 - x1 * y0;
+        float invArea = 1.0f / area;
+
+        __m128 pixelOffset = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        __m128 zero = _mm_setzero_ps();
+        for (int py = minY; py <= maxY; ++py)
+        {
+            float cy = py + 0.5f;
+            __m128 row0 = _mm_set1_ps(b0 * cy + c0);
+            __m128 row1 = _mm_set1_ps(b1 * cy + c1);
+            __m128 row2 = _mm_set1_ps(b2 * cy + c2);
+            float* depthRow = occlusionDepth + py * occlusionWidth;
+
+            for (int px = minX; px <= maxX; px += 4)
+            {
+                __m128 cx = _mm_add_ps(_mm_set1_ps((float)px), pixelOffset);
+                __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a0), cx), row0);
+                __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a1), cx), row1);
+                __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a2), cx), row2);
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+                if (_mm_movemask_ps(inside) == 0)
+                    continue;
+
+                __m128 depth = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, _mm_set1_ps(z0)), _mm_mul_ps(e1, _mm_set1_ps(z1))), _mm_mul_ps(e2, _mm_set1_ps(z2))), _mm_set1_ps(invArea));
+                __m128 stored = _mm_loadu_ps(depthRow + px);
+                __m128 nearest = _mm_min_ps(stored, depth);
+                _mm_storeu_ps(depthRow + px, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, stored)));
+            }
+        }
+    }
+}
+
+// Reduce 2x2 blocks of the previous level, clamping at odd edges
+void buildHiZLevel(int level)
+{
+    int sourceWidth = hiZWidth[level - 1], sourceHeight = hiZHeight[level - 1];
+    const float* sourceMin = hiZMin[level - 1].data();
+    const float* sourceMax = hiZMax[level - 1].data();
+
+    for (int y = 0; y < hiZHeight[level]; ++y)
+    {
+        int y0 = y * 2, y1 = std::min(y * 2 + 1, sourceHeight - 1);
+        for (int x = 0; x < hiZWidth[level]; ++x)
+        {
+            int x0 = x * 2, x1 = std::min(x * 2 + 1, sourceWidth - 1);
+            hiZMin[level][y * hiZWidth[level] + x] = std::min(std::min(sourceMin[y0 * sourceWidth + x0], sourceMin[y0 * sourceWidth + x1]),
+                std::min(sourceMin[y1 * sourceWidth + x0], sourceMin[y1 * sourceWidth + x1]));
+            hiZMax[level][y * hiZWidth[level] + x] = std::max(std::max(sourceMax[y0 * sourceWidth + x0], sourceMax[y0 * sourceWidth + x1]),
+                std::max(sourceMax[y1 * sourceWidth + x0], sourceMax[y1 * sourceWidth + x1]));
+        }
+    }
+}
+
+// Test a screen rect and its nearest depth against the pyramid
+bool isRectOccluded(int minX, int minY, int maxX, int maxY, float nearestDepth)
+{
+    // Pick the level where the rect spans at most 4 texels per axis
+    int level = 0;
+    while (level < hiZLevelCount - 1 && std::max((maxX >> level) - (minX >> level), (maxY >> level) - (minY >> level)) > 3)
+        ++level;
+
+    // Quick accept: in front of everything two levels up
+    int coarse = std::min(level + 2, hiZLevelCount - 1);
+    float coarseMin = 1.0f;
+    for (int y = minY >> coarse; y <= maxY >> coarse; ++y)
+        for (int x = minX >> coarse; x <= maxX >> coarse; ++x)
+            coarseMin = std::min(coarseMin, hiZMin[coarse][y * hiZWidth[coarse] + x]);
+    if (nearestDepth <= coarseMin)
+        return false;
+
+    // Occluded only if behind the farthest occluder depth in the rect
+    float farthest = 0.0f;
+    for (int y = minY >> level; y <= maxY >> level; ++y)
+        for (int x = minX >> level; x <= maxX >> level; ++x)
+            farthest = std::max(farthest, hiZMax[level][y * hiZWidth[level] + x]);
+    return nearestDepth > farthest;
+}
+
+// Rasterize the marked occluders and flag every other object hidden behind them
+void cullOccludedObjects(const glm::mat4& viewProjection)
+{
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    occludedObjectCount = 0;
+    for (SceneObject& object : sceneObjects)
+        object.visible = object.enabled;
+
+    if (!occlusionCullingEnabled)
+    {
+        occlusionCullingMs = 0.0;
+        return;
+    }
+
+    // Project occluder triangles, skipping any that cross the near plane
+    occluderTriangles.clear();
+    for (const SceneObject& object : sceneObjects)
+    {
+        if (!object.isOccluder || !object.enabled)
+            continue;
+
+        glm::mat4 mvp = viewProjection * object.model;
+        for (int i = 0; i + 2 < object.meshIndexCount; i += 3)
+        {
+            OccluderTriangle tri;
+            bool clipped = false;
+            for (int v = 0; v < 3; ++v)
+            {
+                const GLfloat* position = object.meshVertices + object.meshIndices[i + v] * 8;
+                glm::vec4 clip = mvp * glm::vec4(position[0], position[1], position[2], 1.0f);
+                if (clip.w < 1e-4f)
+                {
+                    clipped = true;
+                    break;
+                }
+                tri.x[v] = (clip.x / clip.w * 0.5f + 0.5f) * occlusionWidth;
+                tri.y[v] = (clip.y / clip.w * 0.5f + 0.5f) * occlusionHeight;
+                tri.z[v] = clip.z / clip.w * 0.5f + 0.5f;
+            }
+            if (clipped)
+                continue;
+
+            tri.minY = std::max((int)floorf(std::min(tri.y[0], std::min(tri.y[1], tri.y[2]))), 0);
+            tri.maxY = std::min((int)ceilf(std::max(tri.y[0], std::max(tri.y[1], tri.y[2]))), occlusionHeight - 1);
+            if (tri.minY <= tri.maxY)
+                occluderTriangles.push_back(tri);
+        }
+    }
+
+    // Clear and rasterize in parallel bands, then copy into the pyramid base
+    const int bandHeight = (occlusionHeight + occlusionBands - 1) / occlusionBands;
+    parallelFor(occlusionBands, [bandHeight](int band) {
+        int bandMinY = band * bandHeight;
+        int bandMaxY = std::min(bandMinY + bandHeight, occlusionHeight);
+        std::fill(occlusionDepth + bandMinY * occlusionWidth, occlusionDepth + bandMaxY * occlusionWidth, 1.0f);
+        rasterizeOccluderBand(bandMinY, bandMaxY);
+        std::copy(occlusionDepth + bandMinY * occlusionWidth, occlusionDepth + bandMaxY * occlusionWidth, hiZMin[0].begin() + bandMinY * occlusionWidth);
+        std::copy(occlusionDepth + bandMinY * occlusionWidth, occlusionDepth + bandMaxY * occlusionWidth, hiZMax[0].begin() + bandMinY * occlusionWidth);
+    });
+
+    for (int level = 1; level < hiZLevelCount; ++level)
+        buildHiZLevel(level);
+
+    // Test each object's screen-space bounds
+    for (SceneObject& object : sceneObjects)
+    {
+        if (object.isOccluder || !object.visible)
+            continue;
+
+        glm::mat4 mvp = viewProjection * object.model;
+        float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f, nearestDepth = 1.0f;
+        bool crossesNearPlane = false;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            glm::vec4 clip = mvp * glm::vec4(corner & 1 ? object.boundsMax.x : object.boundsMin.x,
+                corner & 2 ? object.boundsMax.y : object.boundsMin.y,
+                corner & 4 ? object.boundsMax.z : object.boundsMin.z, 1.0f);
+            if (clip.w < 1e-4f)
+            {
+                crossesNearPlane = true;
+                break;
+            }
+            float x = (clip.x / clip.w * 0.5f + 0.5f) * occlusionWidth;
+            float y = (clip.y / clip.w * 0.5f + 0.5f) * occlusionHeight;
+            minX = std::min(minX, x);
+            maxX = std::max(maxX, x);
+            minY = std::min(minY, y);
+            maxY = std::max(maxY, y);
+            nearestDepth = std::min(nearestDepth, clip.z / clip.w * 0.5f + 0.5f);
+        }
+
+        // Objects straddling the camera or off screen are left to the GPU
+        if (crossesNearPlane || maxX < 0.0f || maxY < 0.0f || minX >= occlusionWidth || minY >= occlusionHeight)
+            continue;
+
+        int rectMinX = std::max((int)minX, 0), rectMinY = std::max((int)minY, 0);
+        int rectMaxX = std::min((int)maxX, occlusionWidth - 1), rectMaxY = std::min((int)maxY, occlusionHeight - 1);
+        if (isRectOccluded(rectMinX, rectMinY, rectMaxX, rectMaxY, std::max(nearestDepth, 0.0f)))
+        {
+            object.visible = false;
+            ++occludedObjectCount;
+        }
+    }
+
+    occlusionCullingMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+}
+
+// Create the GPU timer queries and the offscreen scene target
+void initDynamicResolution()
+{
+    glGenQueries(gpuTimerQueryCount, gpuTimerQueries);
+    glGenQueries(gpuTimerQueryCount * 2, &primitiveTimestampQueries[0][0]);
+    glGenFramebuffers(1, &sceneFramebuffer);
+    glGenTextures(1, &sceneColorTexture);
+    glGenRenderbuffers(1, &sceneDepthBuffer);
+    resizeSceneFramebuffer();
+}
+
+// Reallocate the offscreen target for the current window size
+void resizeSceneFramebuffer()
+{
+    if (sceneFramebuffer == 0 || width <= 0 || height <= 0)
+        return;
+
+    sceneFramebufferWidth = std::max((int)(width * maxResolutionScale + 0.5f), 1);
+    sceneFramebufferHeight = std::max((int)(height * maxResolutionScale + 0.5f), 1);
+
+    glBindTexture(GL_TEXTURE_2D, sceneColorTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, sceneFramebufferWidth, sceneFramebufferHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glBindRenderbuffer(GL_RENDERBUFFER, sceneDepthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, sceneFramebufferWidth, sceneFramebufferHeight);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneColorTexture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, sceneDepthBuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cerr << "Scene framebuffer is incomplete" << std::endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Adjust the scale from recent GPU times and bind the offscreen target
+void beginSceneFrame()
+{
+    // Read the oldest query once the GPU has finished it
+    if (gpuTimerFrame >= gpuTimerQueryCount)
+    {
+        GLuint oldestQuery = gpuTimerQueries[gpuTimerFrame % gpuTimerQueryCount];
+        GLint available = 0;
+        glGetQueryObjectiv(oldestQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+        {
+            GLuint64 elapsedNs = 0;
+            glGetQueryObjectui64v(oldestQuery, GL_QUERY_RESULT, &elapsedNs);
+            float frameMs = elapsedNs / 1.0e6f;
+            gpuFrameMs = gpuFrameMs == 0.0f ? frameMs : gpuFrameMs * 0.9f + frameMs * 0.1f;
+            gpuFrameMsTotal += frameMs;
+            ++gpuFrameSamples;
+        }
+    }
+
+    // Same for the primitive timestamps, if that frame stamped them; otherwise the pair is from an older frame
+    int slot = gpuTimerFrame % gpuTimerQueryCount;
+    if (primitiveTimingIssued[slot])
+    {
+        GLint available = 0;
+        glGetQueryObjectiv(primitiveTimestampQueries[slot][1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+        {
+            GLuint64 startNs = 0, endNs = 0;
+            glGetQueryObjectui64v(primitiveTimestampQueries[slot][0], GL_QUERY_RESULT, &startNs);
+            glGetQueryObjectui64v(primitiveTimestampQueries[slot][1], GL_QUERY_RESULT, &endNs);
+            primitiveGpuMsTotal += (endNs - startNs) / 1.0e6;
+            ++primitiveGpuSamples;
+        }
+        primitiveTimingIssued[slot] = false;
+    }
+
+    // Pixel cost scales with the square of the scale; ignore changes inside a 5% band
+    ++framesSinceResolutionChange;
+    if (!dynamicResolutionEnabled)
+        resolutionScale = maxResolutionScale;
+    else if (gpuFrameMs > 0.0f && framesSinceResolutionChange >= resolutionAdjustFrames
+        && fabsf(gpuFrameMs - targetFrameMs) > targetFrameMs * 0.05f)
+    {
+        float ratio = glm::clamp(sqrtf(targetFrameMs / gpuFrameMs), 0.9f, 1.1f);
+        resolutionScale = glm::clamp(resolutionScale * ratio, minResolutionScale, maxResolutionScale);
+        framesSinceResolutionChange = 0;
+    }
+
+    renderWidth = std::max((int)(width * resolutionScale + 0.5f), 1);
+    renderHeight = std::max((int)(height * resolutionScale + 0.5f), 1);
+
+    glBeginQuery(GL_TIME_ELAPSED, gpuTimerQueries[gpuTimerFrame % gpuTimerQueryCount]);
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+    glViewport(0, 0, renderWidth, renderHeight);
+}
+
+// Upscale the offscreen target into the window
+void endSceneFrame()
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFramebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, width, height, GL_COLOR_BUFFER_BIT, upscaleFilter);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, width, height);
+
+    glEndQuery(GL_TIME_ELAPSED);
+    ++gpuTimerFrame;
+}
+
+// Stamp the start of the primitive draws; beginSceneFrame reads the pair back a few frames later
+void beginPrimitiveTiming()
+{
+    int slot = gpuTimerFrame % gpuTimerQueryCount;
+    glQueryCounter(primitiveTimestampQueries[slot][0], GL_TIMESTAMP);
+    primitiveTimingIssued[slot] = true;
+}
+
+void endPrimitiveTiming()
+{
+    glQueryCounter(primitiveTimestampQueries[gpuTimerFrame % gpuTimerQueryCount][1], GL_TIMESTAMP);
+}
+
+// Blit the last rendered frame again without redrawing the scene
+void presentPreviousFrame()
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFramebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, width, height, GL_COLOR_BUFFER_BIT, upscaleFilter);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// CPU time used by every thread of the process; std::clock() is wall time on MSVC
+double processCpuSeconds()
+{
+#ifdef _WIN32
+    FILETIME creation, exitTime, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exitTime, &kernel, &user))
+        return 0.0;
+    ULARGE_INTEGER kernelTime, userTime;
+    kernelTime.LowPart = kernel.dwLowDateTime;
+    kernelTime.HighPart = kernel.dwHighDateTime;
+    userTime.LowPart = user.dwLowDateTime;
+    userTime.HighPart = user.dwHighDateTime;
+    return (kernelTime.QuadPart + userTime.QuadPart) * 1e-7; // 100 ns units
+#else
+    timespec time;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time) != 0)
+        return 0.0;
+    return time.tv_sec + time.tv_nsec * 1e-9;
+#endif
+}
+
+// Accumulate the stats of a drawn frame
+void recordFrameStats()
+{
+    ++statsFrameCount;
+    occlusionCullingMsTotal += occlusionCullingMs;
+    occludedObjectTotal += occludedObjectCount;
+    textureBindTotal += textureBindCount;
+}
+
+// Bilinearly resample an RGB image into a size x size one
+void resampleImage(const unsigned char* source, int sourceWidth, int sourceHeight, unsigned char* destination, int size)
+{
+    for (int y = 0; y < size; ++y)
+    {
+        float sy = glm::clamp((y + 0.5f) * sourceHeight / size - 0.5f, 0.0f, (float)(sourceHeight - 1));
+        int y0 = (int)sy, y1 = std::min(y0 + 1, sourceHeight - 1);
+        float fy = sy - y0;
+        for (int x = 0; x < size; ++x)
+        {
+            float sx = glm::clamp((x + 0.5f) * sourceWidth / size - 0.5f, 0.0f, (float)(sourceWidth - 1));
+            int x0 = (int)sx, x1 = std::min(x0 + 1, sourceWidth - 1);
+            float fx = sx - x0;
+            for (int c = 0; c < 3; ++c)
+            {
+                float top = glm::mix((float)source[(y0 * sourceWidth + x0) * 3 + c], (float)source[(y0 * sourceWidth + x1) * 3 + c], fx);
+                float bottom = glm::mix((float)source[(y1 * sourceWidth + x0) * 3 + c], (float)source[(y1 * sourceWidth + x1) * 3 + c], fx);
+                destination[(y * size + x) * 3 + c] = (unsigned char)(glm::mix(top, bottom, fy) + 0.5f);
+            }
+        }
+    }
+}
+
+// Pack the images into one array layer each and upload the material parameters
+void initMaterials(unsigned char* const* images, const int* imageWidths, const int* imageHeights, int imageCount)
+{
+    // Layers take the size of the largest image; the others are resampled up to it
+    materialTextureSize = 1;
+    for (int i = 0; i < imageCount; ++i)
+    {
+        if (images[i])
+            materialTextureSize = std::max(materialTextureSize, std::max(imageWidths[i], imageHeights[i]));
+    }
+
+    glGenTextures(1, &materialTextureArray);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, materialTextureArray);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB8, materialTextureSize, materialTextureSize, imageCount, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+    std::vector<unsigned char> layer(materialTextureSize * materialTextureSize * 3);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int i = 0; i < imageCount; ++i)
+    {
+        // Missing images become a mid-gray layer
+        if (!images[i])
+            std::fill(layer.begin(), layer.end(), 128);
+        else if (imageWidths[i] == materialTextureSize && imageHeights[i] == materialTextureSize)
+            std::copy(images[i], images[i] + layer.size(), layer.begin());
+        else
+            resampleImage(images[i], imageWidths[i], imageHeights[i], layer.data(), materialTextureSize);
+
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, materialTextureSize, materialTextureSize, 1, GL_RGB, GL_UNSIGNED_BYTE, layer.data());
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    // The uniform buffer always holds maxMaterials entries
+    std::vector<Material> bufferData(maxMaterials, Material{ glm::vec4(1.0f), glm::vec4(0.5f, 6.5f, 128.0f, 0.0f) });
+    std::copy(materials.begin(), materials.begin() + std::min((int)materials.size(), maxMaterials), bufferData.begin());
+
+    glGenBuffers(1, &materialBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, materialBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, bufferData.size() * sizeof(Material), bufferData.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, materialBlockBinding, materialBuffer);
+}
+
+// Tell a program whether to read the material array this frame; its bindings are set at link time
+void useMaterials(GLuint program)
+{
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "useMaterialArray"), materialArrayEnabled);
+}
+
+// Bind the material array once for the whole frame
+void bindMaterialArray()
+{
+    glActiveTexture(GL_TEXTURE0 + materialTextureUnit);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, materialArrayEnabled ? materialTextureArray : 0);
+    glActiveTexture(GL_TEXTURE0 + diffuseTextureUnit);
+    if (materialArrayEnabled)
+        ++textureBindCount;
+}
+
+// Draw a buffered object with its own VAO and texture
+void drawSceneObject(const SceneObject& object, GLuint program)
+{
+    glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(object.model));
+    glUniform1i(glGetUniformLocation(program, "materialIndex"), object.material);
+    if (!materialArrayEnabled)
+    {
+        glBindTexture(GL_TEXTURE_2D, object.texture);
+        ++textureBindCount;
+    }
+    glBindVertexArray(object.vao);
+    glDrawElements(GL_TRIANGLES, object.indexCount, GL_UNSIGNED_INT, 0);
+    primitiveTriangleCount += object.primitiveType >= 0 ? object.indexCount / 3 : 0;
+}
+
+// Draw the visible primitives without buffers, batching matching ones as instances
+void drawProceduralPrimitives(GLuint program)
+{
+    glm::mat4 models[maxProceduralInstances];
+    glm::vec4 shapes[maxProceduralInstances];
+    GLint instanceMaterials[maxProceduralInstances];
+    std::vector<char>& batched = proceduralBatched;
+    batched.assign(sceneObjects.size(), 0);
+
+    glUseProgram(program);
+    glBindVertexArray(proceduralVAO);
+    for (size_t i = 0; i < sceneObjects.size(); ++i)
+    {
+        const SceneObject& first = sceneObjects[i];
+        if (batched[i] || !first.visible || first.primitiveType < 0)
+            continue;
+
+        int instanceCount = 0;
+        for (size_t j = i; j < sceneObjects.size() && instanceCount < maxProceduralInstances; ++j)
+        {
+            const SceneObject& other = sceneObjects[j];
+            if (batched[j] || !other.visible || other.primitiveType != first.primitiveType || other.segments != first.segments
+                || other.rings != first.rings || (!materialArrayEnabled && other.texture != first.texture))
+                continue;
+
+            models[instanceCount] = other.model;
+            shapes[instanceCount] = other.shape;
+            instanceMaterials[instanceCount] = other.material;
+            ++instanceCount;
+            batched[j] = 1;
+        }
+
+        glUniform1i(glGetUniformLocation(program, "primitiveType"), first.primitiveType);
+        glUniform2i(glGetUniformLocation(program, "tessellation"), first.segments, first.rings);
+        glUniformMatrix4fv(glGetUniformLocation(program, "instanceModel"), instanceCount, GL_FALSE, glm::value_ptr(models[0]));
+        glUniform4fv(glGetUniformLocation(program, "instanceShape"), instanceCount, glm::value_ptr(shapes[0]));
+        glUniform1iv(glGetUniformLocation(program, "instanceMaterial"), instanceCount, instanceMaterials);
+        if (!materialArrayEnabled)
+        {
+            glBindTexture(GL_TEXTURE_2D, first.texture);
+            ++textureBindCount;
+        }
+        glDrawArraysInstanced(GL_TRIANGLES, 0, first.segments * first.rings * 6, instanceCount);
+        primitiveTriangleCount += first.segments * first.rings * 2 * instanceCount;
+    }
+}
+
+// Scale the tessellation of every procedural primitive; the buffered meshes keep theirs
+void changeProceduralTessellation(float factor)
+{
+    for (SceneObject& object : sceneObjects)
+    {
+        if (object.primitiveType < 0)
+            continue;
+
+        object.segments = glm::clamp((int)(object.segments * factor), 3, 1024);
+        if (object.primitiveType != primitiveCylinder)
+            object.rings = glm::clamp((int)(object.rings * factor), 2, 512);
+        cout << "Procedural " << object.name << ": " << object.segments << " x " << object.rings << endl;
+    }
+    sceneDirty = true;
+}
+
+// Fill node nodeIndex from bvhTriangleOrder[first, first + count), splitting at the median on the longest axis
+void buildBvhNode(int nodeIndex, int first, int count)
+{
+    glm::vec3 boundsMin(1e30f), boundsMax(-1e30f), centroidMin(1e30f), centroidMax(-1e30f);
+    for (int i = first; i < first + count; ++i)
+    {
+        const BakeTriangle& tri = bakeTriangles[bvhTriangleOrder[i]];
+        for (int v = 0; v < 3; ++v)
+        {
+            boundsMin = glm::min(boundsMin, tri.position[v]);
+            boundsMax = glm::max(boundsMax, tri.position[v]);
+        }
+        glm::vec3 centroid = (tri.position[0] + tri.position[1] + tri.position[2]) / 3.0f;
+        centroidMin = glm::min(centroidMin, centroid);
+        centroidMax = glm::max(centroidMax, centroid);
+    }
+
+    bvhNodes[nodeIndex].boundsMin = boundsMin;
+    bvhNodes[nodeIndex].boundsMax = boundsMax;
+    bvhNodes[nodeIndex].first = first;
+    bvhNodes[nodeIndex].count = count;
+    if (count <= 4)
+        return;
+
+    glm::vec3 extent = centroidMax - centroidMin;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    int middle = first + count / 2;
+    std::nth_element(bvhTriangleOrder.begin() + first, bvhTriangleOrder.begin() + middle, bvhTriangleOrder.begin() + first + count,
+        [axis](int a, int b) {
+            const BakeTriangle& ta = bakeTriangles[a];
+            const BakeTriangle& tb = bakeTriangles[b];
+            return ta.position[0][axis] + ta.position[1][axis] + ta.position[2][axis]
+                < tb.position[0][axis] + tb.position[1][axis] + tb.position[2][axis];
+        });
+
+    // Children are allocated as a pair, left first
+    int left = (int)bvhNodes.size();
+    bvhNodes.resize(bvhNodes.size() + 2);
+    bvhNodes[nodeIndex].first = left;
+    bvhNodes[nodeIndex].count = 0;
+    buildBvhNode(left, first, middle - first);
+    buildBvhNode(left + 1, middle, first + count - middle);
+}
+
+// Slab test against a node's bounds
+bool rayHitsBounds(const glm::vec3& origin, const glm::vec3& inverseDirection, float maxT, const BvhNode& node)
+{
+    float tMin = 0.0f, tMax = maxT;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float t0 = (node.boundsMin[axis] - origin[axis]) * inverseDirection[axis];
+        float t1 = (node.boundsMax[axis] - origin[axis]) * inverseDirection[axis];
+        tMin = std::max(tMin, std::min(t0, t1));
+        tMax = std::min(tMax, std::max(t0, t1));
+    }
+    return tMin <= tMax;
+}
+
+// True if any triangle blocks the ray before maxT
+bool isRayOccluded(const glm::vec3& origin, const glm::vec3& direction, float maxT)
+{
+    glm::vec3 inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    int stack[64];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const BvhNode& node = bvhNodes[stack[--stackSize]];
+        if (!rayHitsBounds(origin, inverseDirection, maxT, node))
+            continue;
+
+        if (node.count == 0)
+        {
+            stack[stackSize++] = node.first;
+            stack[stackSize++] = node.first + 1;
+            continue;
+        }
+
+        // Moller-Trumbore against each leaf triangle
+        for (int i = node.first; i < node.first + node.count; ++i)
+        {
+            const BakeTriangle& tri = bakeTriangles[bvhTriangleOrder[i]];
+            glm::vec3 edge1 = tri.position[1] - tri.position[0];
+            glm::vec3 edge2 = tri.position[2] - tri.position[0];
+            glm::vec3 p = glm::cross(direction, edge2);
+            float determinant = glm::dot(edge1, p);
+            if (fabsf(determinant) < 1e-9f)
+                continue;
+
+            float inverseDeterminant = 1.0f / determinant;
+            glm::vec3 s = origin - tri.position[0];
+            float u = glm::dot(s, p) * inverseDeterminant;
+            if (u < 0.0f || u > 1.0f)
+                continue;
+            glm::vec3 q = glm::cross(s, edge1);
+            float v = glm::dot(direction, q) * inverseDeterminant;
+            if (v < 0.0f || u + v > 1.0f)
+                continue;
+            float t = glm::dot(edge2, q) * inverseDeterminant;
+            if (t > 1e-4f && t < maxT)
+                return true;
+        }
+    }
+    return false;
+}
+
+// Atlas texel position for a corner of triangle (cell, half); texel centers span the cell edge to edge
+glm::vec2 lightmapCorner(int triangle, int corner)
+{
+    // Even triangles cover (0,0) (1,0) (1,1) of the cell, odd ones (1,1) (0,1) (0,0),
+    // which matches the p0 p1 p2 / p2 p3 p0 quads of every mesh here
+    static const glm::vec2 corners[2][3] = {
+        { glm::vec2(0.0f, 0.0f), glm::vec2(1.0f, 0.0f), glm::vec2(1.0f, 1.0f) },
+        { glm::vec2(1.0f, 1.0f), glm::vec2(0.0f, 1.0f), glm::vec2(0.0f, 0.0f) }
+    };
+    int cell = triangle / 2;
+    glm::vec2 origin((float)(cell % lightmapCellsPerRow * lightmapCellTexels), (float)(cell / lightmapCellsPerRow * lightmapCellTexels));
+    glm::vec2 texel = origin + glm::vec2(0.5f, 0.5f) + corners[triangle % 2][corner] * (float)(lightmapCellTexels - 1);
+    return glm::vec2(texel.x / lightmapSize, texel.y / lightmapSize);
+}
+
+// Gather world triangles, build the BVH and the expanded meshes carrying lightmap UVs
+void buildLightmapMeshes()
+{
+    bakeTriangles.clear();
+    objectLightmaps.clear();
+    for (const SceneObject& object : sceneObjects)
+    {
+        ObjectLightmap lightmap = { 0, 0, 0, (int)bakeTriangles.size() };
+        glm::mat3 normalMatrix = glm::mat3(glm::transpose(glm::inverse(object.model)));
+        glm::vec3 center = glm::vec3(object.model * glm::vec4((object.boundsMin + object.boundsMax) * 0.5f, 1.0f));
+
+        // Disabled objects (the plane while the terrain is on) neither cast nor receive baked light
+        int indexCount = object.enabled ? object.meshIndexCount : 0;
+        for (int i = 0; i + 2 < indexCount; i += 3)
+        {
+            BakeTriangle tri;
+            for (int v = 0; v < 3; ++v)
+            {
+                const GLfloat* vertex = object.meshVertices + object.meshIndices[i + v] * 8;
+                tri.position[v] = glm::vec3(object.model * glm::vec4(vertex[0], vertex[1], vertex[2], 1.0f));
+                tri.normal[v] = glm::normalize(normalMatrix * glm::vec3(vertex[3], vertex[4], vertex[5]));
+            }
+
+            // Without vertex normals, face away from the object's center (or up for flat objects)
+            if (!object.hasVertexNormals)
+            {
+                glm::vec3 faceNormal = glm::normalize(glm::cross(tri.position[1] - tri.position[0], tri.position[2] - tri.position[0]));
+                float facing = glm::dot(faceNormal, (tri.position[0] + tri.position[1] + tri.position[2]) / 3.0f - center);
+                if (facing < -1e-4f || (fabsf(facing) <= 1e-4f && faceNormal.y < 0.0f))
+                    faceNormal = -faceNormal;
+                tri.normal[0] = tri.normal[1] = tri.normal[2] = faceNormal;
+            }
+            bakeTriangles.push_back(tri);
+        }
+        lightmap.vertexCount = (GLsizei)(bakeTriangles.size() - lightmap.firstTriangle) * 3;
+        objectLightmaps.push_back(lightmap);
+    }
+
+    // Every object's cells share one square atlas
+    int cellCount = ((int)bakeTriangles.size() + 1) / 2;
+    lightmapCellsPerRow = std::max((int)ceilf(sqrtf((float)cellCount)), 1);
+    lightmapSize = lightmapCellsPerRow * lightmapCellTexels;
+
+    bvhTriangleOrder.resize(bakeTriangles.size());
+    for (size_t i = 0; i < bvhTriangleOrder.size(); ++i)
+        bvhTriangleOrder[i] = (int)i;
+    bvhNodes.assign(1, BvhNode());
+    if (!bakeTriangles.empty())
+        buildBvhNode(0, 0, (int)bakeTriangles.size());
+
+    // Expand to unshared vertices: position, normal or color, UV, lightmap UV
+    for (size_t objectIndex = 0; objectIndex < sceneObjects.size(); ++objectIndex)
+    {
+        const SceneObject& object = sceneObjects[objectIndex];
+        ObjectLightmap& lightmap = objectLightmaps[objectIndex];
+        std::vector<GLfloat> expanded;
+        expanded.reserve(lightmap.vertexCount * 10);
+        for (int i = 0; i < lightmap.vertexCount; ++i)
+        {
+            const GLfloat* vertex = object.meshVertices + object.meshIndices[i] * 8;
+            glm::vec2 lightmapUV = lightmapCorner(lightmap.firstTriangle + i / 3, i % 3);
+            expanded.insert(expanded.end(), vertex, vertex + 8);
+            expanded.push_back(lightmapUV.x);
+            expanded.push_back(lightmapUV.y);
+        }
+
+        glGenVertexArrays(1, &lightmap.vao);
+        glGenBuffers(1, &lightmap.vbo);
+        glBindVertexArray(lightmap.vao);
+        glBindBuffer(GL_ARRAY_BUFFER, lightmap.vbo);
+        glBufferData(GL_ARRAY_BUFFER, expanded.size() * sizeof(GLfloat), expanded.data(), GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 10 * sizeof(GLfloat), (GLvoid*)0);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 10 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 10 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 10 * sizeof(GLfloat), (GLvoid*)(8 * sizeof(GLfloat)));
+        glEnableVertexAttribArray(3);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+}
+
+// Free the lightmap meshes so the next bake gathers the scene again
+void releaseLightmapMeshes()
+{
+    for (ObjectLightmap& lightmap : objectLightmaps)
+    {
+        glDeleteVertexArrays(1, &lightmap.vao);
+        glDeleteBuffers(1, &lightmap.vbo);
+    }
+    objectLightmaps.clear();
+}
+
+// Cheap per-texel hash for the AO sample pattern, so bakes are repeatable
+float bakeRandom(unsigned int& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state & 0xFFFFFF) / 16777216.0f;
+}
+
+// Bake one atlas cell: cosine-weighted AO and direct light with a shadow ray, kept apart for the material's ambient
+void bakeLightmapCell(int cell, const glm::vec3& lightPos, std::vector<glm::vec2>& texels, std::vector<unsigned char>& covered)
+{
+    int originX = cell % lightmapCellsPerRow * lightmapCellTexels;
+    int originY = cell / lightmapCellsPerRow * lightmapCellTexels;
+    for (int j = 0; j < lightmapCellTexels; ++j)
+    {
+        for (int i = 0; i < lightmapCellTexels; ++i)
+        {
+            // Texels on or below the diagonal belong to the even triangle
+            float u = (float)i / (lightmapCellTexels - 1), v = (float)j / (lightmapCellTexels - 1);
+            int triangle = cell * 2 + (j <= i ? 0 : 1);
+            if (triangle >= (int)bakeTriangles.size())
+                continue;
+
+            float b0, b1, b2;
+            if (j <= i)
+            {
+                b0 = 1.0f - u;
+                b1 = u - v;
+                b2 = v;
+            }
+            else
+            {
+                b0 = u;
+                b1 = v - u;
+                b2 = 1.0f - v;
+            }
+
+            const BakeTriangle& tri = bakeTriangles[triangle];
+            glm::vec3 normal = glm::normalize(tri.normal[0] * b0 + tri.normal[1] * b1 + tri.normal[2] * b2);
+            glm::vec3 position = tri.position[0] * b0 + tri.position[1] * b1 + tri.position[2] * b2 + normal * 1e-3f;
+
+            // Direct diffuse from the point light
+            glm::vec3 toLight = lightPos - position;
+            float lightDistance = glm::length(toLight);
+            glm::vec3 lightDir = toLight / lightDistance;
+            float diffuse = std::max(glm::dot(normal, lightDir), 0.0f);
+            if (diffuse > 0.0f && isRayOccluded(position, lightDir, lightDistance))
+                diffuse = 0.0f;
+
+            // Ambient occlusion over a cosine-weighted hemisphere around the normal
+            glm::vec3 tangent = glm::normalize(glm::cross(fabsf(normal.y) < 0.9f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f), normal));
+            glm::vec3 bitangent = glm::cross(normal, tangent);
+            unsigned int seed = (unsigned int)((originY + j) * lightmapSize + originX + i) * 9781u + 1u;
+            int unoccluded = 0;
+            for (int sample = 0; sample < aoSampleCount; ++sample)
+            {
+                float r = sqrtf(bakeRandom(seed));
+                float angle = 2.0f * glm::pi<float>() * bakeRandom(seed);
+                glm::vec3 direction = tangent * (r * cosf(angle)) + bitangent * (r * sinf(angle)) + normal * sqrtf(std::max(1.0f - r * r, 0.0f));
+                if (!isRayOccluded(position, direction, aoMaxDistance))
+                    ++unoccluded;
+            }
+            float ambientOcclusion = (float)unoccluded / aoSampleCount;
+
+            int texel = (originY + j) * lightmapSize + originX + i;
+            texels[texel] = glm::vec2(ambientOcclusion, diffuse);
+            covered[texel] = 1;
+        }
+    }
+}
+
+// Ray trace every cell of the atlas and upload it
+void bakeLightmaps(const glm::vec3& lightPos, bool singleThreaded)
+{
+    if (objectLightmaps.empty())
+        buildLightmapMeshes();
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+    std::vector<glm::vec2> texels(lightmapSize * lightmapSize, glm::vec2(0.0f));
+    std::vector<unsigned char> covered(lightmapSize * lightmapSize, 0);
+    int cellCount = lightmapCellsPerRow * lightmapCellsPerRow;
+
+    // Cells write disjoint texels, so they bake independently
+    auto bakeCell = [&](int cell) { bakeLightmapCell(cell, lightPos, texels, covered); };
+    if (singleThreaded)
+    {
+        for (int cell = 0; cell < cellCount; ++cell)
+            bakeCell(cell);
+    }
+    else
+        parallelFor(cellCount, bakeCell);
+
+    // Fill unused texels from covered neighbours so filtering never pulls in black
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        std::vector<unsigned char> coveredBefore = covered;
+        for (int y = 0; y < lightmapSize; ++y)
+        {
+            for (int x = 0; x < lightmapSize; ++x)
+            {
+                if (coveredBefore[y * lightmapSize + x])
+                    continue;
+                glm::vec2 sum(0.0f);
+                int count = 0;
+                for (int dy = -1; dy <= 1; ++dy)
+                {
+                    for (int dx = -1; dx <= 1; ++dx)
+                    {
+                        int nx = x + dx, ny = y + dy;
+                        if (nx >= 0 && ny >= 0 && nx < lightmapSize && ny < lightmapSize && coveredBefore[ny * lightmapSize + nx])
+                        {
+                            sum += texels[ny * lightmapSize + nx];
+                            ++count;
+                        }
+                    }
+                }
+                if (count > 0)
+                {
+                    texels[y * lightmapSize + x] = sum / (float)count;
+                    covered[y * lightmapSize + x] = 1;
+                }
+            }
+        }
+    }
+
+    lightmapBakeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+
+    std::vector<unsigned char> pixels(texels.size() * 2);
+    for (size_t i = 0; i < texels.size(); ++i)
+    {
+        pixels[i * 2 + 0] = (unsigned char)(glm::clamp(texels[i].x, 0.0f, 1.0f) * 255.0f + 0.5f);
+        pixels[i * 2 + 1] = (unsigned char)(glm::clamp(texels[i].y, 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+
+    if (lightmapTexture == 0)
+        glGenTextures(1, &lightmapTexture);
+    glBindTexture(GL_TEXTURE_2D, lightmapTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8, lightmapSize, lightmapSize, 0, GL_RG, GL_UNSIGNED_BYTE, pixels.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    lightmapsBaked = true;
+
+    cout << "Lightmap bake: " << lightmapSize << "x" << lightmapSize << " atlas, " << bakeTriangles.size() << " triangles, "
+         << lightmapBakeMs << " ms on " << (singleThreaded ? 1 : (int)workerThreads.size() + 1) << " threads" << endl;
+}
+
+// Draw every visible static object with the baked atlas; one texture bind for all of them
+void drawLightmappedObjects(GLuint program)
+{
+    glUseProgram(program);
+    glActiveTexture(GL_TEXTURE0 + lightmapTextureUnit);
+    glBindTexture(GL_TEXTURE_2D, lightmapTexture);
+    glActiveTexture(GL_TEXTURE0 + diffuseTextureUnit);
+    ++textureBindCount;
+
+    for (size_t i = 0; i < sceneObjects.size(); ++i)
+    {
+        const SceneObject& object = sceneObjects[i];
+        if (!object.visible)
+            continue;
+
+        glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(object.model));
+        glUniform1i(glGetUniformLocation(program, "materialIndex"), object.material);
+        if (!materialArrayEnabled)
+        {
+            glBindTexture(GL_TEXTURE_2D, object.texture);
+            ++textureBindCount;
+        }
+        glBindVertexArray(objectLightmaps[i].vao);
+        glDrawArrays(GL_TRIANGLES, 0, objectLightmaps[i].vertexCount);
+    }
+}
+
+// Pack chunk coordinates into a map key
+long long terrainKey(int x, int z)
+{
+    return ((long long)x << 32) | (unsigned int)z;
+}
+
+// Smoothly interpolated lattice noise in [-1, 1]
+float terrainNoise(float x, float z)
+{
+    auto lattice = [](int i, int j) {
+        unsigned int h = (unsigned int)i * 374761393u + (unsigned int)j * 668265263u;
+        h = (h ^ (h >> 13)) * 1274126177u;
+        return ((h ^ (h >> 16)) & 0xFFFF) / 32767.5f - 1.0f;
+    };
+    int i = (int)floorf(x), j = (int)floorf(z);
+    float fx = x - i, fz = z - j;
+    fx = fx * fx * (3.0f - 2.0f * fx);
+    fz = fz * fz * (3.0f - 2.0f * fz);
+    return glm::mix(glm::mix(lattice(i, j), lattice(i + 1, j), fx), glm::mix(lattice(i, j + 1), lattice(i + 1, j + 1), fx), fz);
+}
+
+// Heightfield sampled by the chunk loaders; flat at the old plane height under the objects
+float terrainHeight(float x, float z)
+{
+    float height = 0.0f, amplitude = 1.0f, frequency = 0.15f;
+    for (int octave = 0; octave < 5; ++octave)
+    {
+        height += amplitude * terrainNoise(x * frequency, z * frequency);
+        amplitude *= 0.5f;
+        frequency *= 2.0f;
+    }
+
+    float blend = glm::clamp((sqrtf(x * x + z * z) - 2.5f) / 3.0f, 0.0f, 1.0f);
+    return 0.6f + blend * blend * (3.0f - 2.0f * blend) * terrainHeightScale * height;
+}
+
+// Fill a chunk's vertices: position, normal, tiled UV
+void generateTerrainChunk(int chunkX, int chunkZ, std::vector<GLfloat>& vertices)
+{
+    const float spacing = terrainChunkSize / terrainChunkQuads;
+    vertices.clear();
+    vertices.reserve((terrainChunkQuads + 1) * (terrainChunkQuads + 1) * 8);
+    for (int j = 0; j <= terrainChunkQuads; ++j)
+    {
+        for (int i = 0; i <= terrainChunkQuads; ++i)
+        {
+            // From integer vertex coordinates, so neighbouring chunks produce bit-identical edges
+            float x = (chunkX * terrainChunkQuads + i) * spacing;
+            float z = (chunkZ * terrainChunkQuads + j) * spacing;
+
+            // Normals from the heightfield itself, so they agree across chunk edges
+            glm::vec3 normal = glm::normalize(glm::vec3(terrainHeight(x - spacing, z) - terrainHeight(x + spacing, z), 2.0f * spacing,
+                terrainHeight(x, z - spacing) - terrainHeight(x, z + spacing)));
+
+            GLfloat vertex[] = { x, terrainHeight(x, z), z, normal.x, normal.y, normal.z, x * 0.5f, z * 0.5f };
+            vertices.insert(vertices.end(), vertex, vertex + 8);
+        }
+    }
+}
+
+// Append the triangles of one LOD; coarser neighbours get every other edge vertex so seams match
+void appendTerrainIndices(int lod, int coarserMask, std::vector<GLushort>& indices)
+{
+    const int n = terrainChunkQuads, step = 1 << lod;
+    auto vertex = [n](int i, int j) { return (GLushort)(j * (n + 1) + i); };
+
+    // Inner grid, one step in from every edge
+    for (int j = step; j < n - step; j += step)
+    {
+        for (int i = step; i < n - step; i += step)
+        {
+            GLushort quad[] = { vertex(i, j), vertex(i + step, j), vertex(i + step, j + step), vertex(i + step, j + step), vertex(i, j + step), vertex(i, j) };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+
+    // Border strips zip the outer edge to the inner grid's edge; the four trapezoids meet on the diagonals
+    for (int side = 0; side < 4; ++side)
+    {
+        int outerStep = (coarserMask & (1 << side)) ? step * 2 : step;
+        auto sideVertex = [&](int t, int depth) {
+            switch (side)
+            {
+            case 0: return vertex(t, depth);
+            case 1: return vertex(t, n - depth);
+            case 2: return vertex(depth, t);
+            default: return vertex(n - depth, t);
+            }
+        };
+
+        int outer = 0, inner = step;
+        while (outer < n || inner < n - step)
+        {
+            bool advanceOuter = inner >= n - step || (outer < n && outer + outerStep <= inner + step);
+            if (advanceOuter)
+            {
+                GLushort tri[] = { sideVertex(outer, 0), sideVertex(outer + outerStep, 0), sideVertex(inner, step) };
+                indices.insert(indices.end(), tri, tri + 3);
+                outer += outerStep;
+            }
+            else
+            {
+                GLushort tri[] = { sideVertex(outer, 0), sideVertex(inner + step, step), sideVertex(inner, step) };
+                indices.insert(indices.end(), tri, tri + 3);
+                inner += step;
+            }
+        }
+    }
+}
+
+// Build the shared index buffer and start the loader threads
+void initTerrain()
+{
+    std::vector<GLushort> indices;
+    for (int lod = 0; lod < terrainLodCount; ++lod)
+    {
+        for (int mask = 0; mask < 16; ++mask)
+        {
+            terrainIndexOffset[lod][mask] = (GLsizei)indices.size();
+            appendTerrainIndices(lod, mask, indices);
+            terrainIndexCount[lod][mask] = (GLsizei)indices.size() - terrainIndexOffset[lod][mask];
+        }
+    }
+
+    glGenBuffers(1, &terrainIndexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrainIndexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), indices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    for (int i = 0; i < terrainLoaderCount; ++i)
+    {
+        terrainLoaders.emplace_back([] {
+            for (;;)
+            {
+                TerrainChunkData chunk;
+                {
+                    std::unique_lock<std::mutex> lock(terrainMutex);
+                    terrainWake.wait(lock, [] { return terrainLoaderQuit || !terrainRequests.empty(); });
+                    if (terrainLoaderQuit)
+                        return;
+                    chunk.x = terrainRequests.front().first;
+                    chunk.z = terrainRequests.front().second;
+                    terrainRequests.pop_front();
+                }
+
+                generateTerrainChunk(chunk.x, chunk.z, chunk.vertices);
+
+                {
+                    std::lock_guard<std::mutex> lock(terrainMutex);
+                    terrainLoaded.push_back(std::move(chunk));
+                }
+
+                // Wake the render loop if it is waiting for events
+                glfwPostEmptyEvent();
+            }
+        });
+    }
+}
+
+// Chunks within the load radius of the center chunk as (squared distance, key), nearest first, cut off at maxCount
+void collectWantedTerrainChunks(int centerX, int centerZ, int maxCount, std::vector<std::pair<int, long long>>& wanted)
+{
+    wanted.clear();
+    for (int z = centerZ - terrainLoadRadius; z <= centerZ + terrainLoadRadius; ++z)
+    {
+        for (int x = centerX - terrainLoadRadius; x <= centerX + terrainLoadRadius; ++x)
+        {
+            int distanceSquared = (x - centerX) * (x - centerX) + (z - centerZ) * (z - centerZ);
+            if (distanceSquared <= terrainLoadRadius * terrainLoadRadius)
+                wanted.push_back(std::make_pair(distanceSquared, terrainKey(x, z)));
+        }
+    }
+
+    // Only the nearest maxCount need ordering, so a tight budget sorts less
+    if ((int)wanted.size() > maxCount)
+    {
+        std::nth_element(wanted.begin(), wanted.begin() + maxCount, wanted.end());
+        wanted.resize(maxCount);
+    }
+    std::sort(wanted.begin(), wanted.end());
+}
+
+// Request, upload and evict chunks so the nearest ones within the budget stay resident
+void updateTerrain(const glm::vec3& center)
+{
+    if (!terrainEnabled)
+        return;
+
+    const size_t chunkBytes = (terrainChunkQuads + 1) * (terrainChunkQuads + 1) * 8 * sizeof(GLfloat);
+    const int maxResident = std::max((int)(terrainResidencyBudget / chunkBytes) - terrainMaxInFlight, 1);
+    int centerX = (int)floorf(center.x / terrainChunkSize), centerZ = (int)floorf(center.z / terrainChunkSize);
+
+    // Wanted chunks, nearest first, cut off at the budget
+    std::vector<std::pair<int, long long>> wanted;
+    collectWantedTerrainChunks(centerX, centerZ, maxResident, wanted);
+    std::unordered_set<long long> wantedKeys;
+    for (const auto& entry : wanted)
+        wantedKeys.insert(entry.second);
+
+    std::vector<TerrainChunkData> loaded;
+    {
+        std::lock_guard<std::mutex> lock(terrainMutex);
+
+        // Drop queued requests the camera has moved away from
+        for (auto it = terrainRequests.begin(); it != terrainRequests.end();)
+        {
+            long long key = terrainKey(it->first, it->second);
+            if (wantedKeys.count(key))
+                ++it;
+            else
+            {
+                terrainInFlight.erase(key);
+                it = terrainRequests.erase(it);
+            }
+        }
+
+        // Queue the nearest missing chunks
+        for (const auto& entry : wanted)
+        {
+            if ((int)terrainInFlight.size() >= terrainMaxInFlight)
+                break;
+            if (terrainChunks.count(entry.second) || terrainInFlight.count(entry.second))
+                continue;
+            terrainInFlight.insert(entry.second);
+            terrainRequests.push_back(std::make_pair((int)(entry.second >> 32), (int)(unsigned int)entry.second));
+        }
+
+        // Take a few finished chunks for upload this frame
+        while (!terrainLoaded.empty() && (int)loaded.size() < terrainUploadsPerFrame)
+        {
+            loaded.push_back(std::move(terrainLoaded.back()));
+            terrainLoaded.pop_back();
+        }
+    }
+    terrainWake.notify_all();
+
+    // Evict resident chunks that are no longer wanted
+    for (auto it = terrainChunks.begin(); it != terrainChunks.end();)
+    {
+        if (wantedKeys.count(it->first))
+            ++it;
+        else
+        {
+            terrainFreeBuffers.push_back(std::make_pair(it->second.vao, it->second.vbo));
+            it = terrainChunks.erase(it);
+            ++terrainEvictionCount;
+        }
+    }
+
+    // Upload, reusing buffers of evicted chunks
+    for (TerrainChunkData& data : loaded)
+    {
+        long long key = terrainKey(data.x, data.z);
+        terrainInFlight.erase(key);
+        if (!wantedKeys.count(key) || terrainChunks.count(key))
+            continue;
+
+        TerrainChunk chunk = { data.x, data.z, 0, 0, 0 };
+        if (!terrainFreeBuffers.empty())
+        {
+            chunk.vao = terrainFreeBuffers.back().first;
+            chunk.vbo = terrainFreeBuffers.back().second;
+            terrainFreeBuffers.pop_back();
+        }
+        else
+        {
+            glGenVertexArrays(1, &chunk.vao);
+            glGenBuffers(1, &chunk.vbo);
+            glBindVertexArray(chunk.vao);
+            glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrainIndexBuffer);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)0);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
+            glEnableVertexAttribArray(2);
+            glBindVertexArray(0);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+        glBufferData(GL_ARRAY_BUFFER, data.vertices.size() * sizeof(GLfloat), data.vertices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        terrainChunks[key] = chunk;
+        ++terrainUploadCount;
+        sceneDirty = true;
+    }
+
+    // Free buffers beyond what the budget could ever reuse
+    while ((int)(terrainChunks.size() + terrainFreeBuffers.size()) > maxResident)
+    {
+        glDeleteVertexArrays(1, &terrainFreeBuffers.back().first);
+        glDeleteBuffers(1, &terrainFreeBuffers.back().second);
+        terrainFreeBuffers.pop_back();
+    }
+
+    // Distance LODs, then limit each chunk to one level coarser than its neighbours
+    for (auto& entry : terrainChunks)
+    {
+        TerrainChunk& chunk = entry.second;
+        glm::vec3 chunkCenter((chunk.x + 0.5f) * terrainChunkSize, center.y, (chunk.z + 0.5f) * terrainChunkSize);
+        chunk.lod = std::min((int)(glm::length(chunkCenter - center) / (terrainChunkSize * terrainLodDistance)), terrainLodCount - 1);
+    }
+    for (int pass = 0; pass < terrainLodCount; ++pass)
+    {
+        for (auto& entry : terrainChunks)
+        {
+            TerrainChunk& chunk = entry.second;
+            const int neighbours[4][2] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+            for (const auto& offset : neighbours)
+            {
+                auto neighbour = terrainChunks.find(terrainKey(chunk.x + offset[0], chunk.z + offset[1]));
+                if (neighbour != terrainChunks.end())
+                    chunk.lod = std::min(chunk.lod, neighbour->second.lod + 1);
+            }
+        }
+    }
+}
+
+// Draw the resident chunks, stitching edges that border a coarser neighbour
+void drawTerrain(GLuint program)
+{
+    terrainTriangleCount = 0;
+    if (!terrainEnabled)
+        return;
+
+    glm::mat4 identity(1.0f);
+    glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(identity));
+    glUniform1i(glGetUniformLocation(program, "materialIndex"), sceneObjects[planeObjectIndex].material);
+    if (!materialArrayEnabled)
+    {
+        glBindTexture(GL_TEXTURE_2D, sceneObjects[planeObjectIndex].texture);
+        ++textureBindCount;
+    }
+
+    for (const auto& entry : terrainChunks)
+    {
+        const TerrainChunk& chunk = entry.second;
+        const int neighbours[4][2] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+        int coarserMask = 0;
+        for (int side = 0; side < 4; ++side)
+        {
+            auto neighbour = terrainChunks.find(terrainKey(chunk.x + neighbours[side][0], chunk.z + neighbours[side][1]));
+            if (neighbour != terrainChunks.end() && neighbour->second.lod > chunk.lod)
+                coarserMask |= 1 << side;
+        }
+
+        glBindVertexArray(chunk.vao);
+        glDrawElements(GL_TRIANGLES, terrainIndexCount[chunk.lod][coarserMask], GL_UNSIGNED_SHORT,
+            (GLvoid*)(terrainIndexOffset[chunk.lod][coarserMask] * sizeof(GLushort)));
+        terrainTriangleCount += terrainIndexCount[chunk.lod][coarserMask] / 3;
+    }
+}
+
+// Stop the loaders and free every chunk
+void shutdownTerrain()
+{
+    {
+        std::lock_guard<std::mutex> lock(terrainMutex);
+        terrainLoaderQuit = true;
+    }
+    terrainWake.notify_all();
+    for (std::thread& loader : terrainLoaders)
+        loader.join();
+    terrainLoaders.clear();
+
+    for (auto& entry : terrainChunks)
+        terrainFreeBuffers.push_back(std::make_pair(entry.second.vao, entry.second.vbo));
+    terrainChunks.clear();
+    for (auto& buffers : terrainFreeBuffers)
+    {
+        glDeleteVertexArrays(1, &buffers.first);
+        glDeleteBuffers(1, &buffers.second);
+    }
+    terrainFreeBuffers.clear();
+    glDeleteBuffers(1, &terrainIndexBuffer);
+}
+
+// Allocate the particle arrays and the instance ring
+void initParticles()
+{
+    for (std::vector<float>* array : { &particlePositionX, &particlePositionY, &particlePositionZ, &particleVelocityX,
+             &particleVelocityY, &particleVelocityZ, &particleAge, &particleMaterial })
+        array->assign(maxParticles, 0.0f);
+
+    // Fountains on the box, the cylinder and the sphere, plus one at the front of the plane
+    particleEmitters = {
+        { glm::vec3(-1.9f, 1.2f, 0.0f), glm::vec3(0.0f, 3.0f, 0.0f), 0.8f, 1 },
+        { glm::vec3(-0.65f, 0.9f + cylinderHeight / 2.0f, 0.0f), glm::vec3(0.0f, 2.5f, 0.0f), 0.6f, 1 },
+        { glm::vec3(1.0f, 1.05f + sphereRadius, 0.0f), glm::vec3(0.0f, 3.5f, 0.0f), 0.6f, 2 },
+        { glm::vec3(0.0f, 0.6f, 1.5f), glm::vec3(0.0f, 2.0f, -1.0f), 0.5f, 0 }
+    };
+
+    initParticleTerrain();
+
+    particleSectionBytes = (GLsizeiptr)maxParticles * 4 * sizeof(GLfloat);
+    glGenVertexArrays(1, &particleVAO);
+    glGenBuffers(1, &particleBuffer);
+    glBindVertexArray(particleVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, particleBuffer);
+    glBufferData(GL_ARRAY_BUFFER, particleSectionBytes * particleRingSections, NULL, GL_STREAM_DRAW);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribDivisor(0, 1);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+// Cache the heightfield around the emitters so terrain collision doesn't evaluate the noise per particle
+void initParticleTerrain()
+{
+    const int samples = particleTerrainCells + 1;
+    const float spacing = 2.0f * particleTerrainExtent / particleTerrainCells;
+    particleTerrainHeights.resize(samples * samples);
+    for (int j = 0; j < samples; ++j)
+        for (int i = 0; i < samples; ++i)
+            particleTerrainHeights[j * samples + i] = terrainHeight(i * spacing - particleTerrainExtent, j * spacing - particleTerrainExtent);
+}
+
+// Bilinear height from the cache, matching the finest terrain level; outside it, the heightfield itself
+float particleTerrainHeight(float x, float z)
+{
+    const int samples = particleTerrainCells + 1;
+    float u = (x + particleTerrainExtent) * (particleTerrainCells / (2.0f * particleTerrainExtent));
+    float v = (z + particleTerrainExtent) * (particleTerrainCells / (2.0f * particleTerrainExtent));
+    if (particleTerrainHeights.empty() || !(u >= 0.0f && v >= 0.0f && u < particleTerrainCells && v < particleTerrainCells))
+        return terrainHeight(x, z);
+
+    int i = (int)u, j = (int)v;
+    float fu = u - i, fv = v - j;
+    const float* row = &particleTerrainHeights[j * samples + i];
+    return glm::mix(glm::mix(row[0], row[1], fu), glm::mix(row[samples], row[samples + 1], fu), fv);
+}
+
+// Step ring particles [first, last) four at a time and write their instance data
+void simulateParticleBatch(int first, int last, float deltaTime, float* instances)
+{
+    const __m128 dt = _mm_set1_ps(deltaTime);
+    const __m128 gravityX = _mm_set1_ps(particleGravity.x * deltaTime);
+    const __m128 gravityY = _mm_set1_ps(particleGravity.y * deltaTime);
+    const __m128 gravityZ = _mm_set1_ps(particleGravity.z * deltaTime);
+    const __m128 drag = _mm_set1_ps(std::max(1.0f - particleDrag * deltaTime, 0.0f));
+    const __m128 planeHeight = _mm_set1_ps(particleGroundHeight);
+    const __m128 planeHalfSize = _mm_set1_ps(particleGroundHalfSize);
+    const __m128 noGround = _mm_set1_ps(-FLT_MAX);
+    const __m128 restitution = _mm_set1_ps(-particleRestitution);
+    const __m128 friction = _mm_set1_ps(particleFriction);
+    const __m128 lifetime = _mm_set1_ps(particleLifetime);
+    const __m128 lifeScale = _mm_set1_ps(0.999f / particleLifetime); // Keeps the fraction below the next material
+    const __m128 dead = _mm_set1_ps(-1.0f);
+    const __m128 signBit = _mm_set1_ps(-0.0f);
+    const __m128 restSpeed = _mm_set1_ps(1e-3f); // Slower than this is zeroed, before bounces decay into denormals
+
+    for (int i = first; i < last; i += 4)
+    {
+        int slot = particleHead + i;
+        if (slot >= maxParticles)
+            slot -= maxParticles;
+
+        __m128 vx = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(&particleVelocityX[slot]), gravityX), drag);
+        __m128 vy = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(&particleVelocityY[slot]), gravityY), drag);
+        __m128 vz = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(&particleVelocityZ[slot]), gravityZ), drag);
+        __m128 px = _mm_add_ps(_mm_loadu_ps(&particlePositionX[slot]), _mm_mul_ps(vx, dt));
+        __m128 oldPy = _mm_loadu_ps(&particlePositionY[slot]);
+        __m128 py = _mm_add_ps(oldPy, _mm_mul_ps(vy, dt));
+        __m128 pz = _mm_add_ps(_mm_loadu_ps(&particlePositionZ[slot]), _mm_mul_ps(vz, dt));
+
+        // Ground under each lane: the terrain everywhere, or the plane's square for particles still above it
+        __m128 ground;
+        if (terrainEnabled)
+        {
+            alignas(16) float x[4], z[4], height[4];
+            _mm_store_ps(x, px);
+            _mm_store_ps(z, pz);
+            for (int lane = 0; lane < 4; ++lane)
+                height[lane] = particleTerrainHeight(x[lane], z[lane]);
+            ground = _mm_load_ps(height);
+        }
+        else
+        {
+            __m128 onPlane = _mm_and_ps(_mm_cmple_ps(_mm_andnot_ps(signBit, px), planeHalfSize),
+                _mm_cmple_ps(_mm_andnot_ps(signBit, pz), planeHalfSize));
+            onPlane = _mm_and_ps(onPlane, _mm_cmpge_ps(oldPy, planeHeight));
+            ground = _mm_or_ps(_mm_and_ps(onPlane, planeHeight), _mm_andnot_ps(onPlane, noGround));
+        }
+
+        // Bounce off the ground, losing vertical speed to restitution and horizontal speed to friction
+        __m128 below = _mm_cmplt_ps(py, ground);
+        py = _mm_max_ps(py, ground);
+        vy = _mm_or_ps(_mm_and_ps(below, _mm_mul_ps(vy, restitution)), _mm_andnot_ps(below, vy));
+        vx = _mm_or_ps(_mm_and_ps(below, _mm_mul_ps(vx, friction)), _mm_andnot_ps(below, vx));
+        vz = _mm_or_ps(_mm_and_ps(below, _mm_mul_ps(vz, friction)), _mm_andnot_ps(below, vz));
+        vx = _mm_andnot_ps(_mm_cmplt_ps(_mm_andnot_ps(signBit, vx), restSpeed), vx);
+        vy = _mm_andnot_ps(_mm_cmplt_ps(_mm_andnot_ps(signBit, vy), restSpeed), vy);
+        vz = _mm_andnot_ps(_mm_cmplt_ps(_mm_andnot_ps(signBit, vz), restSpeed), vz);
+        __m128 age = _mm_add_ps(_mm_loadu_ps(&particleAge[slot]), dt);
+
+        _mm_storeu_ps(&particleVelocityX[slot], vx);
+        _mm_storeu_ps(&particleVelocityY[slot], vy);
+        _mm_storeu_ps(&particleVelocityZ[slot], vz);
+        _mm_storeu_ps(&particlePositionX[slot], px);
+        _mm_storeu_ps(&particlePositionY[slot], py);
+        _mm_storeu_ps(&particlePositionZ[slot], pz);
+        _mm_storeu_ps(&particleAge[slot], age);
+
+        // Transpose into one position and material/life vec4 per particle
+        __m128 life = _mm_add_ps(_mm_loadu_ps(&particleMaterial[slot]), _mm_mul_ps(age, lifeScale));
+        __m128 isDead = _mm_cmpge_ps(age, lifetime);
+        life = _mm_or_ps(_mm_and_ps(isDead, dead), _mm_andnot_ps(isDead, life));
+        _MM_TRANSPOSE4_PS(px, py, pz, life);
+        float* instance = instances + i * 4;
+        _mm_storeu_ps(instance, px);
+        _mm_storeu_ps(instance + 4, py);
+        _mm_storeu_ps(instance + 8, pz);
+        _mm_storeu_ps(instance + 12, life);
+    }
+}
+
+// Retire and emit particles, then simulate them on the pool straight into this frame's ring section
+void updateParticles(float deltaTime)
+{
+    if (!particlesEnabled && particleCount == 0 && particleDrawCount == 0)
+        return;
+
+    // Last frame's draws read the current section; fence it and move on to the next
+    if (particleDrawCount > 0)
+    {
+        particleFences[particleSection] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        particleSection = (particleSection + 1) % particleRingSections;
+    }
+    particleDrawCount = 0;
+    sceneDirty = true;
+
+    // A long stall would launch every particle through the ground
+    float dt = std::min(deltaTime, 0.05f);
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    // Groups of four are emitted together with one birth offset, so the head group dies as one
+    while (particleCount > 0 && particleAge[particleHead + 3] >= particleLifetime)
+    {
+        particleHead = (particleHead + 4) % maxParticles;
+        particleCount -= 4;
+    }
+
+    if (particlesEnabled)
+    {
+        particleEmitCarry += particleEmitRate * dt;
+        int emitCount = (int)particleEmitCarry & ~3;
+        particleEmitCarry -= emitCount;
+        emitCount = std::min(emitCount, maxParticles - particleCount);
+        float birth = 0.0f;
+        for (int i = 0; i < emitCount; ++i)
+        {
+            const ParticleEmitter& emitter = particleEmitters[i % particleEmitters.size()];
+            int slot = (particleHead + particleCount + i) % maxParticles;
+
+            // Spread births over the frame so each frame's particles don't travel as one shell
+            if ((i & 3) == 0)
+                birth = bakeRandom(particleSeed) * dt;
+            glm::vec3 velocity = emitter.velocity + emitter.spread * glm::vec3(bakeRandom(particleSeed) * 2.0f - 1.0f,
+                bakeRandom(particleSeed) * 2.0f - 1.0f, bakeRandom(particleSeed) * 2.0f - 1.0f);
+            glm::vec3 position = emitter.position + velocity * birth;
+            particlePositionX[slot] = position.x;
+            particlePositionY[slot] = position.y;
+            particlePositionZ[slot] = position.z;
+            particleVelocityX[slot] = velocity.x;
+            particleVelocityY[slot] = velocity.y;
+            particleVelocityZ[slot] = velocity.z;
+            particleAge[slot] = birth;
+            particleMaterial[slot] = (float)emitter.material;
+        }
+        particleCount += emitCount;
+    }
+
+    if (particleCount == 0)
+        return;
+
+    // Write without synchronizing; if the GPU still reads this section, orphan the whole ring instead of waiting
+    GLsync& fence = particleFences[particleSection];
+    glBindBuffer(GL_ARRAY_BUFFER, particleBuffer);
+    if (fence)
+    {
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        {
+            glBufferData(GL_ARRAY_BUFFER, particleSectionBytes * particleRingSections, NULL, GL_STREAM_DRAW);
+            for (GLsync& sectionFence : particleFences)
+            {
+                if (sectionFence)
+                    glDeleteSync(sectionFence);
+                sectionFence = 0;
+            }
+            ++particleOrphanCount;
+        }
+        else
+        {
+            glDeleteSync(fence);
+            fence = 0;
+        }
+    }
+
+    GLsizeiptr bytes = (GLsizeiptr)particleCount * 4 * sizeof(GLfloat);
+    float* instances = (float*)glMapBufferRange(GL_ARRAY_BUFFER, particleSection * particleSectionBytes, bytes,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (!instances)
+    {
+        std::cerr << "Failed to map the particle buffer" << std::endl;
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        return;
+    }
+
+    int batchCount = (particleCount + particleBatchSize - 1) / particleBatchSize;
+    parallelFor(batchCount, [&](int batch) {
+        simulateParticleBatch(batch * particleBatchSize, std::min((batch + 1) * particleBatchSize, particleCount), dt, instances);
+    });
+
+    // The contents are undefined if the buffer was lost while mapped, so skip drawing them
+    if (glUnmapBuffer(GL_ARRAY_BUFFER) == GL_TRUE)
+        particleDrawCount = particleCount;
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    particleSimulationMsTotal += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+    particleSimulatedTotal += particleCount;
+    particleUploadBytesTotal += bytes;
+}
+
+// Draw this frame's ring section as instanced billboards textured from the material array
+void drawParticles(GLuint program)
+{
+    if (particleDrawCount == 0)
+        return;
+
+    glUniform1f(glGetUniformLocation(program, "particleSize"), particleSize);
+
+    // Particles always sample the array, so bind it even while the separate textures are in use
+    if (!materialArrayEnabled)
+    {
+        glActiveTexture(GL_TEXTURE0 + materialTextureUnit);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, materialTextureArray);
+        glActiveTexture(GL_TEXTURE0 + diffuseTextureUnit);
+        ++textureBindCount;
+    }
+
+    glBindVertexArray(particleVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, particleBuffer);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid*)(particleSection * particleSectionBytes));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, particleDrawCount);
+}
+
+// Release the instance ring
+void shutdownParticles()
+{
+    for (GLsync& fence : particleFences)
+    {
+        if (fence)
+            glDeleteSync(fence);
+        fence = 0;
+    }
+    glDeleteBuffers(1, &particleBuffer);
+    glDeleteVertexArrays(1, &particleVAO);
+}
+
+// Allocate the view uniform buffer for every viewport
+void initViews()
 {
-    glViewport(0, 0, width, height);
+    glGenBuffers(1, &viewBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, viewBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, maxViews * sizeof(ViewData), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, viewBlockBinding, viewBuffer);
 }
 
-// Vertices and indices for the torus
-const int torusSegments = 20;
-const int torusRings = 10;
-const float torusRadius = 0.25f;
-const float tubeRadius = 0.1f;
+// Fill this frame's views: the main camera alone, or every multi-view type in a grid, first row at the top
+void computeRenderViews()
+{
+    // Without any view types the grid would have no columns, so fall back to the main camera
+    bool grid = multiViewEnabled && !multiViewTypes.empty();
+    int count = grid ? std::min((int)multiViewTypes.size(), maxViews) : 1;
+    int columns = (int)ceilf(sqrtf((float)count));
+    int rows = (count + columns - 1) / columns;
+    viewData.resize(count);
+    viewRects.resize(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        viewRects[i] = glm::vec4((float)(i % columns) / columns, 1.0f - (float)(i / columns + 1) / rows, 1.0f / columns, 1.0f / rows);
+        if (!grid)
+        {
+            computeCameraMatrices(viewData[i].view, viewData[i].projection);
+            viewData[i].position = glm::vec4(cameraPosition, 1.0f);
+        }
+        else
+            computeViewMatrices(multiViewTypes[i], viewRects[i].z * width / std::max(viewRects[i].w * height, 1.0f), viewData[i]);
+    }
+}
 
-GLfloat torusVertices[(torusSegments + 1) * (torusRings + 1) * 8]; // 8 attributes
-GLuint torusIndices[torusSegments * torusRings * 6]; // 6 indices
+// Upload every view at once; draws only switch viewIndex
+void uploadRenderViews()
+{
+    glBindBuffer(GL_UNIFORM_BUFFER, viewBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, viewData.size() * sizeof(ViewData), viewData.data());
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
 
-void generateTorusVerticesAndIndices() {
-    int index = 0;
-    for (int i = 0; i <= torusSegments; ++i) {
-        for (int j = 0; j <= torusRings; ++j) {
-            float u = static_cast<float>(i) / torusSegments;
-            float v = static_cast<float>(j) / torusRings;
-            float theta = 2.0f * PI * u;
-            float phi = 2.0f * PI * v;
+// Restrict drawing to a view's part of the render target
+void beginView(int viewIndex)
+{
+    const glm::vec4& rect = viewRects[viewIndex];
+    int x = (int)(rect.x * renderWidth + 0.5f), y = (int)(rect.y * renderHeight + 0.5f);
+    int right = (int)((rect.x + rect.z) * renderWidth + 0.5f), top = (int)((rect.y + rect.w) * renderHeight + 0.5f);
+    glViewport(x, y, std::max(right - x, 1), std::max(top - y, 1));
+}
 
-            float x = (torusRadius + tubeRadius * cos(phi) ) * cos(theta);
-            float y = tubeRadius * sin(phi) + 0.7f;
-            float z = (torusRadius + tubeRadius * cos(phi)) * sin(theta);
+// Select a program and the view it draws
+void useView(GLuint program, int viewIndex)
+{
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "viewIndex"), viewIndex);
+}
 
-            float nx = cos(phi) * cos(theta);
-            float ny = sin(phi);
-            float nz = cos(phi) * sin(theta);
+// Apply the swap interval; on Windows, raise the timer resolution so the limiter's sleeps aren't 15.6 ms ticks
+void initFramePacing()
+{
+    glfwSwapInterval(swapInterval);
+#ifdef _WIN32
+    timeBeginPeriod(1);
+#endif
+}
 
-            float s = 1.0f - u;
-            float t = 1.0f - v;
+// Mark the scene for redraw and stamp the input so its latency can be followed to the screen
+void recordInput()
+{
+    inputReceived = true;
+    if (pendingInputTimes.size() < maxPendingInputs)
+        pendingInputTimes.push_back(glfwGetTime());
+}
 
-            torusVertices[index++] = x;
-            torusVertices[index++] = y;
-            torusVertices[index++] = z;
-            torusVertices[index++] = nx;
-            torusVertices[index++] = ny;
-            torusVertices[index++] = nz;
-            torusVertices[index++] = s;
-            torusVertices[index++] = t;
-        }
+// Sleep until just before this frame's deadline, then spin the rest; a late frame restarts the schedule
+void limitFrameRate()
+{
+    if (frameLimitFps <= 0.0)
+    {
+        nextFrameDeadline = 0.0;
+        return;
     }
 
-    index = 0;
-    for (int i = 0; i < torusSegments; ++i) {
-        for (int j = 0; j < torusRings; ++j) {
-            int p0 = i * (torusRings + 1) + j;
-            int p1 = (i + 1) * (torusRings + 1) + j;
-            int p2 = (i + 1) * (torusRings + 1) + (j + 1);
-            int p3 = i * (torusRings + 1) + (j + 1);
+    double period = 1.0 / frameLimitFps;
+    double now = glfwGetTime();
+    if (nextFrameDeadline == 0.0 || now - nextFrameDeadline > period)
+        nextFrameDeadline = now;
 
-            torusIndices[index++] = p0;
-            torusIndices[index++] = p1;
-            torusIndices[index++] = p2;
-            torusIndices[index++] = p2;
-            torusIndices[index++] = p3;
-            torusIndices[index++] = p0;
-        }
+    for (;;)
+    {
+        collectPresentedFrames();
+        double remaining = nextFrameDeadline - glfwGetTime();
+        if (remaining <= 0.0)
+            break;
+        if (remaining * 1000.0 > frameLimiterSpinMs)
+            std::this_thread::sleep_for(std::chrono::duration<double>(remaining - frameLimiterSpinMs / 1000.0));
+        else
+            std::this_thread::yield();
     }
+    nextFrameDeadline += period;
 }
 
-// Vertices and indices for the cylinder
-const int cylinderSegments = 20;
-const float cylinderRadius = 0.2f;
-const float cylinderHeight = 0.5f;
-
-GLfloat cylinderVertices[(cylinderSegments + 1) * 2 * 8]; // 8 attributes per vertex
-GLuint cylinderIndices[cylinderSegments * 6]; // 6 indices per quad
-
-void generateCylinderVerticesAndIndices() {
-    int index = 0;
-    for (int i = 0; i <= cylinderSegments; ++i) {
-        float u = static_cast<float>(i) / cylinderSegments;
-        float theta = 2.0f * PI * u;
+// Hand the pending inputs to the frame just swapped and fence it to see when it has been presented
+void submitLatencyFrame(double submitTime)
+{
+    double now = glfwGetTime();
+    if (lastSwapTime > 0.0)
+        frameIntervalMs.push_back((now - lastSwapTime) * 1000.0);
+    lastSwapTime = now;
 
-        float x = cylinderRadius * cos(theta);
-        float y = cylinderHeight / 2.0f;
-        float z = cylinderRadius * sin(theta);
+    for (double inputTime : pendingInputTimes)
+        inputToSubmitMs.push_back((submitTime - inputTime) * 1000.0);
 
-        float nx = cos(theta);
-        float ny = 0.0f;
-        float nz = sin(theta);
+    // Without room for another fence, drop this frame's inputs rather than block
+    if ((int)latencyFrames.size() >= maxLatencyFramesInFlight)
+    {
+        pendingInputTimes.clear();
+        return;
+    }
 
-        float s = 1.0f - u;
-        float t = 0.5f; // You can adjust this for texture mapping
+    LatencyFrame frame;
+    frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frame.submitTime = submitTime;
+    frame.inputTimes.swap(pendingInputTimes);
+    latencyFrames.push_back(std::move(frame));
+}
 
-        cylinderVertices[index++] = x;
-        cylinderVertices[index++] = y;
-        cylinderVertices[index++] = z;
-        cylinderVertices[index++] = nx;
-        cylinderVertices[index++] = ny;
-        cylinderVertices[index++] = nz;
-        cylinderVertices[index++] = s;
-        cylinderVertices[index++] = t;
-
-        cylinderVertices[index++] = x;
-        cylinderVertices[index++] = -y;
-        cylinderVertices[index++] = z;
-        cylinderVertices[index++] = nx;
-        cylinderVertices[index++] = ny;
-        cylinderVertices[index++] = nz;
-        cylinderVertices[index++] = s;
-        cylinderVertices[index++] = 1.0f - t;
+// Retire frames whose swap has completed, oldest first; checked every loop, so times are late by at most that
+void collectPresentedFrames()
+{
+    while (!latencyFrames.empty())
+    {
+        LatencyFrame& frame = latencyFrames.front();
+        GLenum status = glClientWaitSync(frame.fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+
+        double presentTime = glfwGetTime();
+        for (double inputTime : frame.inputTimes)
+            inputToPresentMs.push_back((presentTime - inputTime) * 1000.0);
+        glDeleteSync(frame.fence);
+        latencyFrames.pop_front();
     }
+}
 
-    index = 0;
-    for (int i = 0; i < cylinderSegments; ++i) {
-        int p0 = i * 2;
-        int p1 = (i + 1) * 2;
-        int p2 = (i + 1) * 2 + 1;
-        int p3 = i * 2 + 1;
+void shutdownFramePacing()
+{
+    for (LatencyFrame& frame : latencyFrames)
+        glDeleteSync(frame.fence);
+    latencyFrames.clear();
+#ifdef _WIN32
+    timeEndPeriod(1);
+#endif
+}
 
-        cylinderIndices[index++] = p0;
-        cylinderIndices[index++] = p1;
-        cylinderIndices[index++] = p2;
-        cylinderIndices[index++] = p2;
-        cylinderIndices[index++] = p3;
-        cylinderIndices[index++] = p0;
-    }
+// Value below which the given fraction of the samples fall; reorders the samples
+double percentile(std::vector<double>& samples, double fraction)
+{
+    if (samples.empty())
+        return 0.0;
+    size_t index = std::min((size_t)(fraction * samples.size()), samples.size() - 1);
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
 }
 
-// Vertices and indices for the sphere
-const int sphereSegments = 20;
-const int sphereRings = 20;
-const float sphereRadius = 0.3f;
+// fopen, through fopen_s on MSVC where fopen is deprecated (an error with /sdl)
+FILE* openCaptureFile(const char* path, const char* mode)
+{
+#ifdef _WIN32
+    FILE* file = NULL;
+    if (fopen_s(&file, path, mode) != 0)
+        return NULL;
+    return file;
+#else
+    return fopen(path, mode);
+#endif
+}
 
-GLfloat sphereVertices[(sphereSegments + 1) * (sphereRings + 1) * 8];
-GLuint sphereIndices[sphereSegments * sphereRings * 6];
+// Current local time as YYYYMMDD_HHMMSS; the _s/_r forms are also safe on the writer thread
+void formatCaptureTime(char* buffer, size_t size)
+{
+    std::time_t now = std::time(NULL);
+    std::tm local = {};
+#ifdef _WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+    std::strftime(buffer, size, "%Y%m%d_%H%M%S", &local);
+}
 
-void generateSphereVerticesAndIndices() {
-    int index = 0;
-    for (int i = 0; i <= sphereSegments; ++i) {
-        for (int j = 0; j <= sphereRings; ++j) {
-            float u = static_cast<float>(i) / sphereSegments;
-            float v = static_cast<float>(j) / sphereRings;
-            float theta = 2.0f * glm::pi<float>() * u;
-            float phi = glm::pi<float>() * v;
+// Create the readback ring and start the writer thread
+void initFrameCapture()
+{
+    for (CaptureSlot& slot : captureSlots)
+    {
+        glGenBuffers(1, &slot.pbo);
+        slot.size = 0;
+        slot.fence = 0;
+    }
 
-            float x = sphereRadius * sin(phi) * cos(theta);
-            float y = sphereRadius * cos(phi);
-            float z = sphereRadius * sin(phi) * sin(theta);
+    captureWriter = std::thread([] {
+        FILE* rawFile = NULL;
+        int rawSession = -1, rawWidth = 0, rawHeight = 0, rawFileCount = 0;
+        std::vector<unsigned char> row;
+        for (;;)
+        {
+            CapturedFrame frame;
+            {
+                std::unique_lock<std::mutex> lock(captureMutex);
+                captureReady.wait(lock, [] { return captureWriterQuit || !captureQueue.empty(); });
+                if (captureQueue.empty())
+                    break;
+                frame = std::move(captureQueue.front());
+                captureQueue.pop_front();
+            }
+
+            // Write top-down RGB rows, to a PPM per frame or to the session's raw stream
+            FILE* file = NULL;
+            if (captureAsImageSequence)
+            {
+                char path[256];
+                snprintf(path, sizeof(path), captureImagePattern, frame.frameIndex);
+                file = openCaptureFile(path, "wb");
+                if (file)
+                    fprintf(file, "P6\n%d %d\n255\n", frame.width, frame.height);
+            }
+            else
+            {
+                // The raw stream has no header, so a new session or a resize starts a new file
+                if (rawFile && (frame.session != rawSession || frame.width != rawWidth || frame.height != rawHeight))
+                {
+                    fclose(rawFile);
+                    rawFile = NULL;
+                }
+                if (!rawFile)
+                {
+                    char stamp[32], base[256], path[272];
+                    formatCaptureTime(stamp, sizeof(stamp));
+                    snprintf(base, sizeof(base), captureRawPattern, stamp, rawFileCount++, frame.width, frame.height);
+                    snprintf(path, sizeof(path), "%s.rgb", base);
+                    rawFile = openCaptureFile(path, "wb");
+                    rawSession = frame.session;
+                    rawWidth = frame.width;
+                    rawHeight = frame.height;
+
+                    // Sidecar with what a decoder needs, e.g. ffmpeg -f rawvideo -pixel_format rgb24 -video_size WxH
+                    snprintf(path, sizeof(path), "%s.txt", base);
+                    if (FILE* info = openCaptureFile(path, "w"))
+                    {
+                        fprintf(info, "width %d\nheight %d\npixel_format rgb24\nrow_order top_down\n", frame.width, frame.height);
+                        fclose(info);
+                    }
+                    cout << "Capture: writing " << frame.width << "x" << frame.height << " RGB frames to " << base << ".rgb" << endl;
+                }
+                file = rawFile;
+            }
+
+            if (file)
+            {
+                row.resize(frame.width * 3);
+                for (int y = frame.height - 1; y >= 0; --y)
+                {
+                    const unsigned char* source = frame.pixels.data() + (size_t)y * frame.width * 4;
+                    for (int x = 0; x < frame.width; ++x)
+                    {
+                        row[x * 3 + 0] = source[x * 4 + 2];
+                        row[x * 3 + 1] = source[x * 4 + 1];
+                        row[x * 3 + 2] = source[x * 4 + 0];
+                    }
+                    fwrite(row.data(), 1, row.size(), file);
+                }
+                if (file != rawFile)
+                    fclose(file);
+            }
+
+            std::lock_guard<std::mutex> lock(captureMutex);
+            captureFreeBuffers.push_back(std::move(frame.pixels));
+        }
 
-            float nx = sin(phi) * cos(theta);
-            float ny = cos(phi);
-            float nz = sin(phi) * sin(theta);
+        if (rawFile)
+            fclose(rawFile);
+    });
+}
 
-            float s = 1.0f - u;
-            float t = 1.0f - v;
+// Map every readback whose fence has signaled and queue it for the writer
+void collectCapturedFrames()
+{
+    for (int i = 0; i < captureRingSize; ++i)
+    {
+        // Oldest slot first, so frames reach the writer in order
+        CaptureSlot& slot = captureSlots[(captureNextSlot + i) % captureRingSize];
+        if (!slot.fence)
+            continue;
+
+        GLenum status = glClientWaitSync(slot.fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+        glDeleteSync(slot.fence);
+        slot.fence = 0;
+
+        std::vector<unsigned char> pixels;
+        {
+            std::lock_guard<std::mutex> lock(captureMutex);
+            if ((int)captureQueue.size() >= maxQueuedCaptureFrames)
+            {
+                ++droppedCaptureFrameCount;
+                continue;
+            }
+            if (!captureFreeBuffers.empty())
+            {
+                pixels = std::move(captureFreeBuffers.back());
+                captureFreeBuffers.pop_back();
+            }
+        }
 
-            sphereVertices[index++] = x;
-            sphereVertices[index++] = y;
-            sphereVertices[index++] = z;
-            sphereVertices[index++] = nx;
-            sphereVertices[index++] = ny;
-            sphereVertices[index++] = nz;
-            sphereVertices[index++] = s;
-            sphereVertices[index++] = t;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)slot.width * slot.height * 4, GL_MAP_READ_BIT);
+        if (mapped)
+        {
+            pixels.resize((size_t)slot.width * slot.height * 4);
+            std::copy((const unsigned char*)mapped, (const unsigned char*)mapped + pixels.size(), pixels.begin());
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+
+            captureLatencyMsTotal += (glfwGetTime() - slot.issueTime) * 1000.0;
+            captureLatencyFramesTotal += drawnFrameIndex - slot.frameIndex;
+            ++capturedFrameCount;
+
+            {
+                std::lock_guard<std::mutex> lock(captureMutex);
+                captureQueue.push_back(CapturedFrame{ std::move(pixels), slot.width, slot.height, slot.frameIndex, slot.session });
+            }
+            captureReady.notify_one();
         }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
     }
+}
 
-    index = 0;
-    for (int i = 0; i < sphereSegments; ++i) {
-        for (int j = 0; j < sphereRings; ++j) {
-            int p0 = i * (sphereRings + 1) + j;
-            int p1 = (i + 1) * (sphereRings + 1) + j;
-            int p2 = (i + 1) * (sphereRings + 1) + (j + 1);
-            int p3 = i * (sphereRings + 1) + (j + 1);
+// Start an asynchronous readback of the window's back buffer
+void captureFrame()
+{
+    ++drawnFrameIndex;
+    if (!frameCaptureEnabled || width <= 0 || height <= 0)
+        return;
 
-            sphereIndices[index++] = p0;
-            sphereIndices[index++] = p1;
-            sphereIndices[index++] = p2;
-            sphereIndices[index++] = p2;
-            sphereIndices[index++] = p3;
-            sphereIndices[index++] = p0;
-        }
+    // Never wait on the GPU: if the next slot is still in flight, drop this frame
+    CaptureSlot& slot = captureSlots[captureNextSlot];
+    if (slot.fence)
+    {
+        ++droppedCaptureFrameCount;
+        return;
+    }
+
+    GLsizeiptr size = (GLsizeiptr)width * height * 4;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    if (slot.size != size)
+    {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        slot.size = size;
+    }
+    glReadBuffer(GL_BACK);
+    glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.width = width;
+    slot.height = height;
+    slot.frameIndex = drawnFrameIndex;
+    slot.session = captureSession;
+    slot.issueTime = glfwGetTime();
+    captureNextSlot = (captureNextSlot + 1) % captureRingSize;
+}
+
+// Let the writer drain its queue, then release the ring
+void shutdownFrameCapture()
+{
+    {
+        std::lock_guard<std::mutex> lock(captureMutex);
+        captureWriterQuit = true;
+    }
+    captureReady.notify_all();
+    if (captureWriter.joinable())
+        captureWriter.join();
+
+    for (CaptureSlot& slot : captureSlots)
+    {
+        if (slot.fence)
+            glDeleteSync(slot.fence);
+        glDeleteBuffers(1, &slot.pbo);
     }
 }
 
+// Print averaged frame stats once per interval
+void printFrameStats(double currentTime)
+{
+    double elapsed = currentTime - lastStatsTime;
+    if (elapsed < statsInterval)
+        return;
+
+    // CPU time covers every thread of the process, so it can exceed 100%
+    double cpuSeconds = processCpuSeconds();
+    double cpuPercent = 100.0 * (cpuSeconds - lastStatsCpuSeconds) / elapsed;
+    double gpuPercent = 100.0 * gpuFrameMsTotal / (elapsed * 1000.0);
+    int frames = std::max(statsFrameCount, 1);
+
+    cout << "Occlusion culling: " << (float)occludedObjectTotal / frames << " objects occluded, "
+         << occlusionCullingMsTotal / frames << " ms" << endl;
+    cout << "Dynamic resolution: scale " << resolutionScale << " (" << renderWidth << "x" << renderHeight << "), GPU "
+         << (gpuFrameSamples > 0 ? gpuFrameMsTotal / gpuFrameSamples : 0.0) << " ms, target " << targetFrameMs << " ms" << endl;
+    cout << "Lazy rendering: " << statsFrameCount << " drawn, " << skippedFrameCount << " skipped, "
+         << representedFrameCount << " re-presented, CPU " << cpuPercent << "%, GPU " << gpuPercent << "%" << endl;
+    cout << "Primitives: " << (proceduralPrimitivesEnabled ? "procedural" : "buffered") << ", "
+         << (proceduralPrimitivesEnabled ? 0 : bufferedPrimitiveBytes) << " bytes vertex/index memory, "
+         << primitiveTriangleCount << " triangles, ";
+    if (primitiveGpuSamples > 0)
+        cout << primitiveGpuMsTotal / primitiveGpuSamples << " ms GPU" << (multiViewEnabled ? " in the first view" : "") << endl;
+    else
+        cout << "GPU not timed" << (lightmapsEnabled ? " with lightmaps" : "") << endl;
+    if (frameCaptureEnabled || capturedFrameCount > 0 || droppedCaptureFrameCount > 0)
+        cout << "Frame capture: " << capturedFrameCount << " captured, " << droppedCaptureFrameCount << " dropped, readback latency "
+             << (capturedFrameCount > 0 ? captureLatencyMsTotal / capturedFrameCount : 0.0) << " ms ("
+             << (capturedFrameCount > 0 ? (double)captureLatencyFramesTotal / capturedFrameCount : 0.0) << " frames)" << endl;
+    if (terrainEnabled)
+        cout << "Terrain: " << terrainChunks.size() << " chunks resident, " << terrainInFlight.size() << " in flight, "
+             << terrainChunks.size() * (terrainChunkQuads + 1) * (terrainChunkQuads + 1) * 8 * sizeof(GLfloat) / 1024 << " KB of "
+             << terrainResidencyBudget / 1024 << " KB budget, " << terrainUploadCount << " uploaded, " << terrainEvictionCount
+             << " evicted, " << terrainTriangleCount << " triangles" << endl;
+    if (particlesEnabled || particleCount > 0 || particleSimulatedTotal > 0)
+        cout << "Particles: " << particleCount << " live, "
+             << (particleSimulationMsTotal > 0.0 ? particleSimulatedTotal / particleSimulationMsTotal : 0.0) << " simulated per ms, "
+             << particleUploadBytesTotal / elapsed / (1024.0 * 1024.0) << " MB/s uploaded, "
+             << particleOrphanCount << " ring orphans" << endl;
+    if (multiViewEnabled)
+        cout << "Multi-view: " << viewData.size() << " views, "
+             << (viewTotal > 0 ? viewCullingMsTotal / viewTotal : 0.0) << " ms culling per view" << endl;
+    cout << "Materials: " << (materialArrayEnabled ? "texture array" : "separate textures") << ", "
+         << (float)textureBindTotal / frames << " texture binds per frame" << endl;
+
+    double intervalMean = 0.0, intervalVariance = 0.0;
+    for (double interval : frameIntervalMs)
+        intervalMean += interval;
+    intervalMean /= std::max<size_t>(frameIntervalMs.size(), 1);
+    for (double interval : frameIntervalMs)
+        intervalVariance += (interval - intervalMean) * (interval - intervalMean);
+    intervalVariance /= std::max<size_t>(frameIntervalMs.size(), 1);
+    cout << "Frame pacing: swap interval " << swapInterval << ", limit " << frameLimitFps << " fps, "
+         << (lateInputSampling ? "late" : "early") << " input sampling, frame time " << intervalMean << " ms (std dev "
+         << std::sqrt(intervalVariance) << " ms, p99 " << percentile(frameIntervalMs, 0.99) << " ms)" << endl;
+    cout << "Input latency: " << inputToPresentMs.size() << " events, to submit p50/p90/p99 "
+         << percentile(inputToSubmitMs, 0.5) << "/" << percentile(inputToSubmitMs, 0.9) << "/" << percentile(inputToSubmitMs, 0.99)
+         << " ms, to present " << percentile(inputToPresentMs, 0.5) << "/" << percentile(inputToPresentMs, 0.9) << "/"
+         << percentile(inputToPresentMs, 0.99) << " ms" << endl;
+
+    lastStatsTime = currentTime;
+    lastStatsCpuSeconds = cpuSeconds;
+    statsFrameCount = 0;
+    occlusionCullingMsTotal = 0.0;
+    occludedObjectTotal = 0;
+    gpuFrameMsTotal = 0.0;
+    gpuFrameSamples = 0;
+    skippedFrameCount = 0;
+    representedFrameCount = 0;
+    primitiveGpuMsTotal = 0.0;
+    primitiveGpuSamples = 0;
+    textureBindTotal = 0;
+    capturedFrameCount = 0;
+    droppedCaptureFrameCount = 0;
+    viewCullingMsTotal = 0.0;
+    frameIntervalMs.clear();
+    inputToSubmitMs.clear();
+    inputToPresentMs.clear();
+    viewTotal = 0;
+    particleSimulationMsTotal = 0.0;
+    particleSimulatedTotal = 0;
+    particleUploadBytesTotal = 0;
+    particleOrphanCount = 0;
+    terrainUploadCount = 0;
+    terrainEvictionCount = 0;
+    captureLatencyMsTotal = 0.0;
+    captureLatencyFramesTotal = 0;
+}
+
 void generateSphereVerticesAndIndices();
 
+// The benchmarks include this file for its CPU-side functions and bring their own main
+#ifndef SCENE_NO_MAIN
 int main()
 {
     if (!glfwInit())
@@ -340,53 +3324,21 @@ int main()
         return -1;
     }
 
-    glViewport(0, 0, 800, 600);
+    glfwGetFramebufferSize(window, &width, &height);
+    glViewport(0, 0, width, height);
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
+    initFramePacing();
 
     glEnable(GL_DEPTH_TEST);
 
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-    glCompileShader(vertexShader);
-
-    GLint success;
-    GLchar infoLog[512];
-    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(vertexShader, sizeof(infoLog), NULL, infoLog);
-        std::cerr << "Vertex shader compilation failed: " << infoLog << std::endl;
-    }
-
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-    glCompileShader(fragmentShader);
-
-    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(fragmentShader, sizeof(infoLog), NULL, infoLog);
-        std::cerr << "Fragment shader compilation failed: " << infoLog << std::endl;
-    }
-
     // Wireframe mode
     //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-
-    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-    if (!success)
-    {
-        glGetProgramInfoLog(shaderProgram, sizeof(infoLog), NULL, infoLog);
-        std::cerr << "Shader program linking failed: " << infoLog << std::endl;
-    }
-
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+    GLuint shaderProgram = createShaderProgram(vertexShaderSource, fragmentShaderSource);
+    GLuint proceduralProgram = createShaderProgram(proceduralVertexShaderSource, fragmentShaderSource);
+    GLuint lightmapProgram = createShaderProgram(lightmapVertexShaderSource, lightmapFragmentShaderSource);
+    GLuint particleProgram = createShaderProgram(particleVertexShaderSource, particleFragmentShaderSource);
 
     GLfloat vertices[] = {
         // Front face
@@ -597,7 +3549,6 @@ int main()
     glBindTexture(GL_TEXTURE_2D, planeTexture);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, planeTexWidth, planeTexHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, planeImage);
     glGenerateMipmap(GL_TEXTURE_2D);
-    SOIL_free_image_data(planeImage);
     glBindTexture(GL_TEXTURE_2D, 0);
 
     GLuint boxTexture;
@@ -605,7 +3556,6 @@ int main()
     glBindTexture(GL_TEXTURE_2D, boxTexture);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, boxTexWidth, boxTexHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, boxImage);
     glGenerateMipmap(GL_TEXTURE_2D);
-    SOIL_free_image_data(boxImage);
     glBindTexture(GL_TEXTURE_2D, 0);
 
     GLuint sphereTexture;
@@ -613,28 +3563,65 @@ int main()
     glBindTexture(GL_TEXTURE_2D, sphereTexture);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, sphereTexWidth, sphereTexHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, sphereImage);
     glGenerateMipmap(GL_TEXTURE_2D);
-    SOIL_free_image_data(sphereImage);
     glBindTexture(GL_TEXTURE_2D, 0);
 
-    // Set up projection matrix (Perspective projection)
-    glm::mat4 projection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f);
+    // Materials: brick plane, blue box, green sphere; layers follow the image order below
+    materials = {
+        { glm::vec4(1.0f), glm::vec4(0.5f, 6.5f, 128.0f, 0.0f) },
+        { glm::vec4(1.0f), glm::vec4(0.5f, 6.5f, 128.0f, 1.0f) },
+        { glm::vec4(1.0f), glm::vec4(0.5f, 6.5f, 128.0f, 2.0f) }
+    };
+    unsigned char* materialImages[] = { planeImage, boxImage, sphereImage };
+    int materialImageWidths[] = { planeTexWidth, boxTexWidth, sphereTexWidth };
+    int materialImageHeights[] = { planeTexHeight, boxTexHeight, sphereTexHeight };
+    initMaterials(materialImages, materialImageWidths, materialImageHeights, 3);
 
-    // Set up view matrix
-    glm::mat4 view = glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    SOIL_free_image_data(planeImage);
+    SOIL_free_image_data(boxImage);
+    SOIL_free_image_data(sphereImage);
 
-    // Set up model matrix
+    // Set up model matrix; view and projection come from the Views uniform buffer each frame
     glm::mat4 model = glm::mat4(1.0f);
 
-    glUseProgram(shaderProgram);
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
+    // Set up model matrices for torus, cylinder and sphere
+    glm::mat4 modelTorus = glm::translate(glm::mat4(1.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    glm::mat4 modelCylinder = glm::translate(glm::mat4(1.0f), glm::vec3(-0.65f, 0.9f, 0.00f));
+    glm::mat4 modelSphere = glm::translate(glm::mat4(1.0f), glm::vec3(1.0f, 1.05f, 0.0f));
+
+    // Scene objects in draw order; the box and plane are the occluders
+    float torusOuter = torusRadius + tubeRadius;
+    sceneObjects = {
+        { "box", VAO, 36, boxTexture, 1, model, glm::vec3(-2.0f, 0.6f, -0.3f), glm::vec3(-1.8f, 1.2f, 0.3f), true, vertices, indices, 36, false, -1, 0, 0, glm::vec4(0.0f), true, true },
+        { "plane", VAO_plane, 6, planeTexture, 0, model, glm::vec3(-2.0f, 0.6f, -2.0f), glm::vec3(2.0f, 0.6f, 2.0f), true, planeVertices, planeIndices, 6, false, -1, 0, 0, glm::vec4(0.0f), true, true },
+        { "cylinder", VAO_cylinder, sizeof(cylinderIndices) / sizeof(GLuint), boxTexture, 1, modelCylinder,
+            glm::vec3(-cylinderRadius, -cylinderHeight / 2.0f, -cylinderRadius), glm::vec3(cylinderRadius, cylinderHeight / 2.0f, cylinderRadius), false,
+            cylinderVertices, cylinderIndices, sizeof(cylinderIndices) / sizeof(GLuint), true,
+            primitiveCylinder, cylinderSegments, 1, glm::vec4(cylinderRadius, cylinderHeight, 0.0f, 0.0f), true, true },
+        { "torus", VAO_torus, sizeof(torusIndices) / sizeof(GLuint), boxTexture, 1, modelTorus,
+            glm::vec3(-torusOuter, 0.7f - tubeRadius, -torusOuter), glm::vec3(torusOuter, 0.7f + tubeRadius, torusOuter), false,
+            torusVertices, torusIndices, sizeof(torusIndices) / sizeof(GLuint), true,
+            primitiveTorus, torusSegments, torusRings, glm::vec4(torusRadius, tubeRadius, 0.7f, 0.0f), true, true },
+        { "sphere", VAO_sphere, sizeof(sphereIndices) / sizeof(GLuint), sphereTexture, 2, modelSphere,
+            glm::vec3(-sphereRadius), glm::vec3(sphereRadius), false,
+            sphereVertices, sphereIndices, sizeof(sphereIndices) / sizeof(GLuint), true,
+            primitiveSphere, sphereSegments, sphereRings, glm::vec4(sphereRadius, 0.0f, 0.0f, 0.0f), true, true }
+    };
+
+    // The buffered primitives keep these on the GPU; the procedural path needs none
+    glGenVertexArrays(1, &proceduralVAO);
+    bufferedPrimitiveBytes = sizeof(cylinderVertices) + sizeof(cylinderIndices) + sizeof(torusVertices)
+        + sizeof(torusIndices) + sizeof(sphereVertices) + sizeof(sphereIndices);
 
-    glUseProgram(shaderProgram);
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
+    initWorkers();
+    initOcclusionCulling();
+    initDynamicResolution();
+    initFrameCapture();
+    initTerrain();
+    initParticles();
+    initViews();
 
+    lastStatsTime = glfwGetTime();
+    lastStatsCpuSeconds = processCpuSeconds();
 
     initCamera();
     while (!glfwWindowShouldClose(window))
@@ -642,103 +3629,172 @@ int main()
         // Set up lighting parameters
         glm::vec3 lightPos(1.0f, 2.0f, 2.0f);
         glm::vec3 lightColor(1.0f, 1.0f, 1.0f);
-        glm::vec3 viewPos = cameraPosition;
+
+        // Wait for the frame limiter
+        limitFrameRate();
+        collectPresentedFrames();
 
         // Set delta time
         GLfloat currentFrame = glfwGetTime();
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
 
-        // Poll camera transformations
-        transformCamera();
+        // Stream terrain chunks around last frame's camera; uploads mark the scene dirty
+        updateTerrain(cameraPosition);
 
-        // Update the view matrix
-        view = glm::lookAt(cameraPosition, getTarget(), cameraUp);
-        //glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
+        // Step the particles into this frame's ring section; live particles keep the scene dirty
+        updateParticles(deltaTime);
 
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        // Hand finished readbacks to the capture writer
+        collectCapturedFrames();
 
-        glUseProgram(shaderProgram);
-        glUniform3fv(glGetUniformLocation(shaderProgram, "lightPos"), 1, glm::value_ptr(lightPos));
-        glUniform3fv(glGetUniformLocation(shaderProgram, "lightColor"), 1, glm::value_ptr(lightColor));
-        glUniform3fv(glGetUniformLocation(shaderProgram, "viewPos"), 1, glm::value_ptr(viewPos));
-        if (orthographicMode) {
-            // Orthographic projection
-            glm::mat4 orthoProjection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, 0.1f, 100.0f);
-            glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(orthoProjection));
-        }
-        else {
-            // Perspective projection
-            glm::mat4 perspectiveProjection = glm::perspective(glm::radians(45.0f), 800.0f / 600.0f, 0.1f, 100.0f);
-            glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(perspectiveProjection));
-        }
-        //glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
-
-        // Set up model matrices for torus and cylinder
-        glm::mat4 modelTorus = glm::mat4(1.0f);
-        glm::mat4 modelCylinder = glm::mat4(1.0f);
-        glm::mat4 modelSphere = glm::mat4(1.0f);
-
-        // Translate the torus
-        modelTorus = glm::translate(modelTorus, glm::vec3(1.0f, 0.0f, 0.0f));
-
-        // Translate the cylinder
-        modelCylinder = glm::translate(modelCylinder, glm::vec3(-0.65f, 0.9f, 0.00f));
-
-        // Translate the sphere
-        modelSphere = glm::translate(modelSphere, glm::vec3(1.0f, 1.05f, 0.0f));
-
-        // Draw the box
-        glBindTexture(GL_TEXTURE_2D, boxTexture);
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
-
-        // Draw the plane
-        glBindTexture(GL_TEXTURE_2D, planeTexture);
-        glBindVertexArray(VAO_plane);
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-
-        // Set up model matrix for cylinder
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(modelCylinder));
-
-        // VBO cylinder vertices
-        glBindBuffer(GL_ARRAY_BUFFER, VBO_cylinder);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(cylinderVertices), cylinderVertices);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        // Sample input after the work that doesn't depend on it, so the simulation doesn't count as input latency
+        if (lateInputSampling)
+            glfwPollEvents();
+
+        // Poll camera transformations
+        bool cameraMoved = transformCamera();
 
-        // Draw the cylinder
-        glBindTexture(GL_TEXTURE_2D, boxTexture);  // Box texture
-        glBindVertexArray(VAO_cylinder);
-        glDrawElements(GL_TRIANGLES, sizeof(cylinderIndices) / sizeof(GLuint), GL_UNSIGNED_INT, 0);
+        // Nothing changed since the last frame, so wait for events instead of redrawing;
+        // capturing keeps drawing so the recording has a steady frame rate
+        if (lazyRenderingEnabled && !inputReceived && !cameraMoved && !sceneDirty && !frameCaptureEnabled)
+        {
+            if (presentRequested)
+            {
+                presentPreviousFrame();
+                glfwSwapBuffers(window);
+                presentRequested = false;
+                ++representedFrameCount;
+            }
+            // While a recent present fence is pending, wake often enough that the idle wait isn't counted
+            // as input latency; those wake-ups aren't skipped frames
+            bool presentPending = !latencyFrames.empty() && glfwGetTime() - latencyFrames.front().submitTime < idleWaitTimeout;
+            if (!presentPending)
+                ++skippedFrameCount;
+            printFrameStats(currentFrame);
+
+            glfwWaitEventsTimeout(presentPending ? latencyPollInterval : idleWaitTimeout);
+
+            // Don't count the time spent waiting as camera movement time or as a frame interval
+            lastFrame = glfwGetTime();
+            lastSwapTime = 0.0;
+            continue;
+        }
+        inputReceived = false;
+        sceneDirty = false;
+        presentRequested = false;
 
-        // Set up model matrix for torus
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(modelTorus));
+        // Every view's camera goes into one uniform buffer; the rest of the frame's setup is shared
+        computeRenderViews();
+        uploadRenderViews();
 
-        // Draw the torus
-        glBindTexture(GL_TEXTURE_2D, boxTexture);  // Box texture
-        glBindVertexArray(VAO_torus);
-        glDrawElements(GL_TRIANGLES, sizeof(torusIndices) / sizeof(GLuint), GL_UNSIGNED_INT, 0);
+        // Render into the scaled offscreen target
+        beginSceneFrame();
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        // Set up model matrix for sphere
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(modelSphere));
+        textureBindCount = 0;
+        bindMaterialArray();
 
-        // VBO sphere vertices
-        glBindBuffer(GL_ARRAY_BUFFER, VBO_sphere);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(sphereVertices), sphereVertices);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        // Bake on first use, or again when asked ('B' bakes on one thread to compare)
+        if (lightmapBakeRequest != 0 || (lightmapsEnabled && !lightmapsBaked))
+        {
+            bakeLightmaps(lightPos, lightmapBakeRequest == 2);
+            lightmapBakeRequest = 0;
+        }
+
+        // Light and material uniforms are program state, so set them once for all the views
+        for (GLuint program : { shaderProgram, proceduralProgram, lightmapProgram, particleProgram })
+        {
+            setFrameUniforms(program, lightPos, lightColor);
+            useMaterials(program);
+        }
 
-        // Draw the sphere
-        glBindTexture(GL_TEXTURE_2D, sphereTexture); // Sphere texture
-        glBindVertexArray(VAO_sphere);
-        glDrawElements(GL_TRIANGLES, sizeof(sphereIndices) / sizeof(GLuint), GL_UNSIGNED_INT, 0);
+        primitiveTriangleCount = 0;
+        double frameCullingMs = 0.0;
+        int frameOccludedObjects = 0;
+        for (int viewIndex = 0; viewIndex < (int)viewData.size(); ++viewIndex)
+        {
+            beginView(viewIndex);
+
+            // Hide objects behind the box and plane; visibility is the only per-view CPU work
+            cullOccludedObjects(viewData[viewIndex].projection * viewData[viewIndex].view);
+            frameCullingMs += occlusionCullingMs;
+            frameOccludedObjects += occludedObjectCount;
+
+            if (lightmapsEnabled)
+            {
+                // Every object is static, so all of them use the baked lighting
+                useView(lightmapProgram, viewIndex);
+                drawLightmappedObjects(lightmapProgram);
+            }
+            else
+            {
+                // Draw the visible box and plane
+                useView(shaderProgram, viewIndex);
+                for (const SceneObject& object : sceneObjects)
+                {
+                    if (object.visible && object.primitiveType < 0)
+                        drawSceneObject(object, shaderProgram);
+                }
+
+                // Time the primitives on whichever path is active, in the first view only
+                if (viewIndex == 0)
+                    beginPrimitiveTiming();
+
+                // Draw the visible torus, cylinder and sphere
+                if (proceduralPrimitivesEnabled)
+                {
+                    useView(proceduralProgram, viewIndex);
+                    drawProceduralPrimitives(proceduralProgram);
+                }
+                else
+                {
+                    for (const SceneObject& object : sceneObjects)
+                    {
+                        if (object.visible && object.primitiveType >= 0)
+                            drawSceneObject(object, shaderProgram);
+                    }
+                }
+                if (viewIndex == 0)
+                    endPrimitiveTiming();
+            }
+
+            // Draw the terrain in place of the ground plane
+            if (terrainEnabled)
+            {
+                useView(shaderProgram, viewIndex);
+                drawTerrain(shaderProgram);
+            }
+
+            // Draw the particles as camera-facing billboards
+            if (particleDrawCount > 0)
+            {
+                useView(particleProgram, viewIndex);
+                drawParticles(particleProgram);
+            }
+        }
+        occlusionCullingMs = frameCullingMs;
+        occludedObjectCount = frameOccludedObjects;
+        viewCullingMsTotal += frameCullingMs;
+        viewTotal += viewData.size();
         glBindVertexArray(0);
 
         glBindTexture(GL_TEXTURE_2D, 0);
 
+        // Upscale to the window
+        endSceneFrame();
+
+        // Read the frame back without waiting for it
+        captureFrame();
+
+        double submitTime = glfwGetTime();
         glfwSwapBuffers(window);
-        glfwPollEvents();
+        submitLatencyFrame(submitTime);
+        if (!lateInputSampling)
+            glfwPollEvents();
+
+        recordFrameStats();
+        printFrameStats(currentFrame);
         // Find Camera position
         //cout << "Camera Position: (" << cameraPosition.x << ", " << cameraPosition.y << ", " << cameraPosition.z << ")" << endl;
     }
@@ -754,14 +3810,36 @@ int main()
     glDeleteBuffers(1, &VBO_sphere);
     glDeleteBuffers(1, &EBO_sphere);
 
+    shutdownFrameCapture();
+    shutdownTerrain();
+    shutdownParticles();
+    glDeleteBuffers(1, &viewBuffer);
+    glDeleteQueries(gpuTimerQueryCount, gpuTimerQueries);
+    glDeleteQueries(gpuTimerQueryCount * 2, &primitiveTimestampQueries[0][0]);
+    glDeleteVertexArrays(1, &proceduralVAO);
+    glDeleteTextures(1, &materialTextureArray);
+    glDeleteBuffers(1, &materialBuffer);
+    glDeleteProgram(proceduralProgram);
+    glDeleteProgram(lightmapProgram);
+    glDeleteProgram(particleProgram);
+    releaseLightmapMeshes();
+    glDeleteTextures(1, &lightmapTexture);
+    glDeleteFramebuffers(1, &sceneFramebuffer);
+    glDeleteTextures(1, &sceneColorTexture);
+    glDeleteRenderbuffers(1, &sceneDepthBuffer);
+
+    shutdownFramePacing();
+    shutdownWorkers();
     glfwTerminate();
 
     return 0;
 }
+#endif
 
 // Define input callback functions
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+    recordInput();
 
     if (action == GLFW_PRESS)
     {
@@ -773,6 +3851,127 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
             orthographicMode = !orthographicMode;
 
         }
+
+        // Toggle occlusion culling when the 'O' key is pressed
+        if (key == GLFW_KEY_O)
+        {
+            occlusionCullingEnabled = !occlusionCullingEnabled;
+            cout << "Occlusion culling: " << (occlusionCullingEnabled ? "on" : "off") << endl;
+        }
+
+        // Toggle lazy rendering when the 'I' key is pressed
+        if (key == GLFW_KEY_I)
+        {
+            lazyRenderingEnabled = !lazyRenderingEnabled;
+            cout << "Lazy rendering: " << (lazyRenderingEnabled ? "on" : "off") << endl;
+        }
+
+        // Toggle baked lightmaps when the 'L' key is pressed
+        if (key == GLFW_KEY_L)
+        {
+            lightmapsEnabled = !lightmapsEnabled;
+            cout << "Lightmaps: " << (lightmapsEnabled ? "on" : "off") << endl;
+        }
+
+        // Rebake the lightmaps on a single thread when the 'B' key is pressed, to compare with the pool
+        if (key == GLFW_KEY_B)
+            lightmapBakeRequest = 2;
+
+        // Rebake the lightmaps on the worker pool when the 'H' key is pressed
+        if (key == GLFW_KEY_H)
+            lightmapBakeRequest = 1;
+
+        // Swap the ground plane for the streamed terrain when the 'T' key is pressed
+        if (key == GLFW_KEY_T)
+        {
+            terrainEnabled = !terrainEnabled;
+            sceneObjects[planeObjectIndex].enabled = !terrainEnabled;
+            cout << "Terrain: " << (terrainEnabled ? "on" : "off") << endl;
+
+            // The bake saw the old ground; gather the scene again before the next one
+            releaseLightmapMeshes();
+            lightmapsBaked = false;
+        }
+
+        // Cycle the terrain residency budget through 2, 4 and 8 MB when the 'N' key is pressed
+        if (key == GLFW_KEY_N)
+        {
+            terrainResidencyBudget = terrainResidencyBudget >= 8 * 1024 * 1024 ? 2 * 1024 * 1024 : terrainResidencyBudget * 2;
+            sceneDirty = true;
+            cout << "Terrain budget: " << terrainResidencyBudget / (1024 * 1024) << " MB" << endl;
+        }
+
+        // Toggle the multi-view grid when the 'G' key is pressed
+        if (key == GLFW_KEY_G)
+        {
+            multiViewEnabled = !multiViewEnabled;
+            cout << "Multi-view: " << (multiViewEnabled ? "on" : "off") << endl;
+        }
+
+        // Toggle vertical sync when the 'Y' key is pressed
+        if (key == GLFW_KEY_Y)
+        {
+            swapInterval = swapInterval == 0 ? 1 : 0;
+            glfwSwapInterval(swapInterval);
+            cout << "Swap interval: " << swapInterval << endl;
+        }
+
+        // Cycle the frame limiter through off, 30, 60 and 120 fps when the 'U' key is pressed
+        if (key == GLFW_KEY_U)
+        {
+            frameLimitFps = frameLimitFps == 0.0 ? 30.0 : frameLimitFps >= 120.0 ? 0.0 : frameLimitFps * 2.0;
+            cout << "Frame limit: " << (frameLimitFps > 0.0 ? std::to_string((int)frameLimitFps) + " fps" : "off") << endl;
+        }
+
+        // Toggle late input sampling when the 'J' key is pressed
+        if (key == GLFW_KEY_J)
+        {
+            lateInputSampling = !lateInputSampling;
+            cout << "Late input sampling: " << (lateInputSampling ? "on" : "off") << endl;
+        }
+
+        // Toggle the particle emitters when the 'K' key is pressed; live particles fall until they expire
+        if (key == GLFW_KEY_K)
+        {
+            particlesEnabled = !particlesEnabled;
+            cout << "Particles: " << (particlesEnabled ? "on" : "off") << endl;
+        }
+
+        // Toggle frame capture when the 'C' key is pressed
+        if (key == GLFW_KEY_C)
+        {
+            frameCaptureEnabled = !frameCaptureEnabled;
+            if (frameCaptureEnabled)
+                ++captureSession;
+            cout << "Frame capture: " << (frameCaptureEnabled ? "on" : "off") << endl;
+        }
+
+        // Toggle the texture array materials when the 'M' key is pressed
+        if (key == GLFW_KEY_M)
+        {
+            materialArrayEnabled = !materialArrayEnabled;
+            cout << "Material texture array: " << (materialArrayEnabled ? "on" : "off") << endl;
+        }
+
+        // Toggle procedural primitives when the 'V' key is pressed
+        if (key == GLFW_KEY_V)
+        {
+            proceduralPrimitivesEnabled = !proceduralPrimitivesEnabled;
+            cout << "Procedural primitives: " << (proceduralPrimitivesEnabled ? "on" : "off") << endl;
+        }
+
+        // Halve or double the procedural tessellation with the '[' and ']' keys
+        if (key == GLFW_KEY_LEFT_BRACKET)
+            changeProceduralTessellation(0.5f);
+        if (key == GLFW_KEY_RIGHT_BRACKET)
+            changeProceduralTessellation(2.0f);
+
+        // Toggle dynamic resolution when the 'R' key is pressed
+        if (key == GLFW_KEY_R)
+        {
+            dynamicResolutionEnabled = !dynamicResolutionEnabled;
+            cout << "Dynamic resolution: " << (dynamicResolutionEnabled ? "on" : "off") << endl;
+        }
     }
     else if (action == GLFW_RELEASE)
     {
@@ -782,6 +3981,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
+    recordInput();
 
     cout << "Camera Speed: " << cameraSpeed << endl;
 
@@ -807,6 +4007,7 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 
 void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
 {
+    recordInput();
     if (action == GLFW_PRESS)
         mouseButtons[button] = true;
     else if (action == GLFW_RELEASE)
@@ -866,6 +4067,10 @@ void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
         cameraPosition.z = target.z + radius * cosf(degPitch) * cosf(degYaw);
     }
 
+    // Plain cursor motion doesn't change the frame
+    if (isPanning || isOrbiting)
+        recordInput();
+
 
 }
 
@@ -878,9 +4083,48 @@ glm::vec3 getTarget()
     return target;
 }
 
+// Camera view plus the orthographic or perspective projection for the window
+void computeCameraMatrices(glm::mat4& view, glm::mat4& projection)
+{
+    view = glm::lookAt(cameraPosition, getTarget(), cameraUp);
+
+    if (orthographicMode) {
+        // Orthographic projection
+        projection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, 0.1f, 100.0f);
+    }
+    else {
+        // Perspective projection
+        projection = glm::perspective(glm::radians(45.0f), (float)width / std::max(height, 1), 0.1f, 100.0f);
+    }
+}
+
+// Matrices and eye of one view type; the axis views look at the middle of the scene from outside it
+void computeViewMatrices(int type, float aspect, ViewData& data)
+{
+    if (type == viewPerspective || type == viewOrthographic)
+    {
+        data.view = glm::lookAt(cameraPosition, getTarget(), cameraUp);
+        data.position = glm::vec4(cameraPosition, 1.0f);
+        if (type == viewPerspective)
+            data.projection = glm::perspective(glm::radians(45.0f), aspect, 0.1f, 100.0f);
+        else
+            data.projection = glm::ortho(-multiViewExtent * aspect, multiViewExtent * aspect, -multiViewExtent, multiViewExtent, 0.1f, 100.0f);
+        return;
+    }
+
+    glm::vec3 direction = type == viewTop ? glm::vec3(0.0f, 1.0f, 0.0f) : type == viewFront ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+    glm::vec3 up = type == viewTop ? glm::vec3(0.0f, 0.0f, -1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::vec3 eye = multiViewCenter + direction * 20.0f;
+    data.view = glm::lookAt(eye, multiViewCenter, up);
+    data.projection = glm::ortho(-multiViewExtent * aspect, multiViewExtent * aspect, -multiViewExtent, multiViewExtent, 0.1f, 100.0f);
+    data.position = glm::vec4(eye, 1.0f);
+}
+
 // Define transformCamera function
-void transformCamera()
+bool transformCamera()
 {
+    glm::vec3 previousPosition = cameraPosition;
+
     // Pan camera
     if (keys[GLFW_KEY_LEFT_ALT] && mouseButtons[GLFW_MOUSE_BUTTON_MIDDLE])
         isPanning = true;
@@ -916,6 +4160,8 @@ void transformCamera()
 
     if (keys[GLFW_KEY_E])
         cameraPosition -= cameraUp * cameraSpeed * deltaTime;
+
+    return cameraPosition != previousPosition;
 }
 
 void initCamera()